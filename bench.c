@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "btr.h"
+#include "disk.h"
+#include "bitmap.h"
+#include "shard.h"
+#include "parallel.h"
+
+// ==================== BENCHMARKS ====================
+
+#define BENCH_IMAGE "bench.img"
+#define BENCH_SCAN_IMAGE "bench-scan.img"
+#define BENCH_IMAGE_BLOCKS 8192
+#define BENCH_SHARD_IMAGE_BLOCKS (BITMAP_BYTES * 8)
+#define BENCH_SHARDS 8
+
+static DiskInterface* bench_image(const char* filename, uint64_t blocks)
+{
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, (off_t)blocks * BLOCK_SIZE) != 0) {
+		fprintf(stderr, "Failed to create %s\n", filename);
+		exit(1);
+	}
+	close(fd);
+
+	return disk_open(filename);
+}
+
+// Write the image back and evict it so the next scan has to read from disk
+static void drop_cache(DiskInterface* disk)
+{
+	size_t length = disk->total_blocks * BLOCK_SIZE;
+
+	msync(disk->disk_base, length, MS_SYNC);
+	madvise(disk->disk_base, length, MADV_DONTNEED);
+	posix_fadvise(disk->disk_file, 0, length, POSIX_FADV_DONTNEED);
+}
+
+static uint64_t high_water(DiskInterface* disk)
+{
+	void *bm = get_block_bitmap(disk);
+	for (uint64_t ii = disk->total_blocks; ii > 0; --ii) {
+		if (bitmap_get(bm, ii - 1)) return ii;
+	}
+	return 0;
+}
+
+// Count blocks that differ from the snapshot, then bring the snapshot up to date
+static uint64_t pages_written(DiskInterface* disk, char* snapshot)
+{
+	uint64_t written = 0;
+	uint64_t limit = high_water(disk);
+
+	for (uint64_t ii = 0; ii < limit; ++ii) {
+		char *block = (char*)get_block(disk, ii);
+		if (memcmp(block, snapshot + ii * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+			memcpy(snapshot + ii * BLOCK_SIZE, block, BLOCK_SIZE);
+			written++;
+		}
+	}
+
+	return written;
+}
+
+// Pages that would be written back if the image were synced every `interval` inserts
+static void bench_ingest_run(bool buffered, int count, int interval)
+{
+	DiskInterface *disk = bench_image(BENCH_IMAGE, BENCH_IMAGE_BLOCKS);
+	char *snapshot = (char*)calloc(disk->total_blocks, BLOCK_SIZE);
+	uint64_t written = 0;
+	struct timespec start, end;
+
+	alloc_page(disk);
+	BTreeNode *root = btree_node_create(disk, false);
+	btree_set_buffered(disk, root->block_number, buffered);
+	pages_written(disk, snapshot);
+
+	srand(42);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < count; i++) {
+		btree_insert(disk, root->block_number, rand() % 1000000 + 1);
+		if ((i + 1) % interval == 0) written += pages_written(disk, snapshot);
+	}
+	btree_flush_buffer(disk, root->block_number);
+	written += pages_written(disk, snapshot);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-10s inserts=%d sync_every=%d pages_written=%lu pages_per_insert=%.3f time=%.3fs\n",
+	       buffered ? "buffered" : "immediate", count, interval, written, (double)written / count, secs);
+
+	free(snapshot);
+	disk_close(disk);
+}
+
+static void bench_ingest(int argc, char** argv)
+{
+	int count = argc > 2 ? atoi(argv[2]) : 1000;
+	int interval = argc > 3 ? atoi(argv[3]) : 1;
+
+	if (interval < 1) interval = 1;
+
+	bench_ingest_run(false, count, interval);
+	bench_ingest_run(true, count, interval);
+}
+
+typedef struct ShardWorker {
+	ShardSet *set;
+	int shard;
+	int count;
+} ShardWorker;
+
+static void* shard_worker(void* p)
+{
+	ShardWorker *w = (ShardWorker*)p;
+	uint64_t base = w->set->super->shards[w->shard].key_start;
+
+	for (int i = 0; i < w->count; i++) {
+		shard_insert(w->set, base + i + 1);
+	}
+
+	return NULL;
+}
+
+// Each thread owns one shard's key range. Built with BTREE_QUIET, writers on
+// different shards share no lock, retired list or stdout.
+static void bench_shard_run(int num_threads, int count)
+{
+	DiskInterface *disk = bench_image(BENCH_IMAGE, BENCH_SHARD_IMAGE_BLOCKS);
+	pthread_t threads[BENCH_SHARDS];
+	ShardWorker workers[BENCH_SHARDS];
+	struct timespec start, end;
+
+	shard_format(disk, BENCH_SHARDS, SHARD_ROUTE_RANGE, (uint64_t)BENCH_SHARDS * count * 4);
+	ShardSet *set = shard_open(disk);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < num_threads; i++) {
+		workers[i].set = set;
+		workers[i].shard = i;
+		workers[i].count = count;
+		pthread_create(&threads[i], NULL, shard_worker, &workers[i]);
+	}
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("threads=%d shards=%d inserts=%d time=%.3fs inserts_per_sec=%.0f\n",
+	       num_threads, BENCH_SHARDS, num_threads * count, secs, num_threads * count / secs);
+
+	shard_close(set);
+	disk_close(disk);
+}
+
+static void bench_shard(int argc, char** argv)
+{
+	int count = argc > 2 ? atoi(argv[2]) : 1000;
+
+	// Every insert takes a leaf plus most of an internal node from the shard's region
+	if (count * 2 > BENCH_SHARD_IMAGE_BLOCKS / BENCH_SHARDS) {
+		fprintf(stderr, "At most %d inserts per thread fit in a shard\n", BENCH_SHARD_IMAGE_BLOCKS / BENCH_SHARDS / 2);
+		return;
+	}
+
+	for (int threads = 1; threads <= BENCH_SHARDS; threads *= 2) {
+		bench_shard_run(threads, count);
+	}
+}
+
+static void bench_scan_run(DiskInterface* disk, uint64_t root_block, const char* label, int window, bool adaptive)
+{
+	BTreeScanOptions opts = { window, 0, adaptive };
+	BTreeScanStats stats;
+
+	drop_cache(disk);
+	btree_scan(disk, root_block, 0, UINT64_MAX, NULL, &opts, &stats);
+
+	printf("%-10s window=%-3d nodes=%lu prefetch_calls=%lu prefetch_blocks=%lu max_ahead=%lu final_window=%d time=%.4fs bandwidth=%.1fMiB/s\n",
+	       label, window, stats.nodes, stats.prefetch_calls, stats.prefetch_blocks, stats.max_ahead,
+	       stats.final_window, stats.seconds, stats.mb_per_sec);
+}
+
+// Scans a freshly rebuilt tree, whose leaves sit on consecutive blocks
+static void bench_scan(int argc, char** argv)
+{
+	int count = argc > 2 ? atoi(argv[2]) : 3000;
+	int window = argc > 3 ? atoi(argv[3]) : SCAN_MAX_WINDOW;
+	uint64_t root_block;
+
+	DiskInterface *src = bench_image(BENCH_IMAGE, BENCH_SHARD_IMAGE_BLOCKS);
+	DiskInterface *dst = bench_image(BENCH_SCAN_IMAGE, BENCH_SHARD_IMAGE_BLOCKS);
+
+	alloc_page(src);
+	BTreeNode *root = btree_node_create(src, false);
+	srand(42);
+	for (int i = 0; i < count; i++) {
+		btree_insert(src, root->block_number, rand() % 1000000 + 1);
+	}
+	int rv = btree_parallel_rebuild(src, root->block_number, dst, 1, 1.0, &root_block);
+
+	if (rv != 0) {
+		fprintf(stderr, "Rebuild failed\n");
+	} else {
+		// Blocks held in flight ahead of the scan should grow with the window
+		bench_scan_run(dst, root_block, "none", 0, false);
+		for (int w = 4; w < window; w *= 4) {
+			bench_scan_run(dst, root_block, "fixed", w, false);
+		}
+		bench_scan_run(dst, root_block, "fixed", window, false);
+		bench_scan_run(dst, root_block, "adaptive", 1, true);
+	}
+
+	disk_close(src);
+	disk_close(dst);
+	unlink(BENCH_SCAN_IMAGE);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && strcmp(argv[1], "ingest") == 0) {
+		bench_ingest(argc, argv);
+	} else if (argc > 1 && strcmp(argv[1], "shard") == 0) {
+		bench_shard(argc, argv);
+	} else if (argc > 1 && strcmp(argv[1], "scan") == 0) {
+		bench_scan(argc, argv);
+	} else {
+		fprintf(stderr, "Usage: %s ingest [inserts] [sync_every]\n", argv[0]);
+		fprintf(stderr, "       %s shard [inserts_per_thread]\n", argv[0]);
+		fprintf(stderr, "       %s scan [keys] [window]\n", argv[0]);
+		return 1;
+	}
+
+	unlink(BENCH_IMAGE);
+	return 0;
+}
@@ -9,7 +9,9 @@ int bitmap_get(void* bm, int ii) {
 void bitmap_put(void* bm, int ii, int vv) {
 	uint64_t* ptr = (uint64_t*)bm;
 	ptr = ptr + ( ii / 64 );
-	*ptr = (vv==0) ? *ptr & ~((uint64_t)1 << (ii % 64)) : *ptr | ((uint64_t)1 << (ii % 64));
+	// Atomic so writers on different shards never lose each other's updates
+	if (vv==0) __atomic_fetch_and(ptr, ~((uint64_t)1 << (ii % 64)), __ATOMIC_RELAXED);
+	else __atomic_fetch_or(ptr, (uint64_t)1 << (ii % 64), __ATOMIC_RELAXED);
 }
 
 void bitmap_print(void* bm, int size) {
@@ -1,10 +1,84 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <limits.h>
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
+#include <time.h>
 #include "btr.h"
 #include "disk.h"
 #include "hash.h"
+#include "hindex.h"
+#include "epoch.h"
+
+#define OLC_RESTART ((uint64_t)-2)
+
+// Nodes write-locked by the current writer; released together when the operation ends
+static __thread BTreeNode **write_set = NULL;
+static __thread int write_set_size = 0;
+static __thread int write_set_capacity = 0;
+static __thread int write_depth = 0;		// Nesting of write operations in progress
+
+// Optimistic locking
+uint64_t btree_node_read_version(BTreeNode* node)
+{
+	uint64_t version;
+	
+	while ((version = __atomic_load_n(&node->version, __ATOMIC_ACQUIRE)) & 1) {
+		sched_yield();
+	}
+	
+	return version;
+}
+
+bool btree_node_validate(BTreeNode* node, uint64_t version)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&node->version, __ATOMIC_RELAXED) == version;
+}
+
+static void btree_node_write_lock(BTreeNode* node)
+{
+	for (int i = 0; i < write_set_size; i++) {
+		if (write_set[i] == node) return;
+	}
+	
+	uint64_t version = __atomic_load_n(&node->version, __ATOMIC_RELAXED);
+	while ((version & 1) || !__atomic_compare_exchange_n(&node->version, &version, version + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		sched_yield();
+		version = __atomic_load_n(&node->version, __ATOMIC_RELAXED);
+	}
+	
+	if (write_set_size == write_set_capacity) {
+		write_set_capacity = write_set_capacity ? write_set_capacity * 2 : 16;
+		write_set = (BTreeNode**)realloc(write_set, write_set_capacity * sizeof(BTreeNode*));
+	}
+	write_set[write_set_size++] = node;
+}
+
+static void btree_write_unlock_all(void)
+{
+	for (int i = 0; i < write_set_size; i++) {
+		__atomic_add_fetch(&write_set[i]->version, 1, __ATOMIC_RELEASE);
+	}
+	write_set_size = 0;
+}
+
+// Every function that locks nodes brackets itself with these, so nested
+// calls share one write set and nothing stays locked once the outermost returns
+static void btree_write_begin(void)
+{
+	write_depth++;
+}
+
+static void btree_write_end(DiskInterface* disk)
+{
+	if (--write_depth > 0) return;
+	
+	btree_write_unlock_all();
+	// This writer holds no nodes now, so retired pages may be reclaimable
+	epoch_collect(disk);
+}
 
 // B-tree core operations
 BTreeNode* btree_node_create(DiskInterface* disk, bool is_leaf)
@@ -20,6 +94,10 @@ BTreeNode* btree_node_create(DiskInterface* disk, bool is_leaf)
 	node->num_keys = 0;
 	node->value = 0;
 	node->parent = 0;
+	node->hash_index = 0;
+	node->version = 0;		// Pages come back only after epoch reclamation, so no reader holds it
+	node->buffered = false;
+	node->num_msgs = 0;
 	
 	for(int i=0; i<MAX_KEYS; i++) node->keys[i]=0;
 	for(int i=0; i<=MAX_KEYS; i++) node->children[i]=0;
@@ -29,7 +107,10 @@ BTreeNode* btree_node_create(DiskInterface* disk, bool is_leaf)
 
 void btree_node_free(DiskInterface* disk, BTreeNode* node)
 {
-	free_page(disk, node->block_number);
+	btree_write_begin();
+	btree_node_write_lock(node);
+	epoch_retire(disk, node->block_number);
+	btree_write_end(disk);
 }
 
 int btree_node_read(DiskInterface* disk, uint64_t block_num, BTreeNode* node)
@@ -49,7 +130,11 @@ int btree_node_write(DiskInterface* disk, BTreeNode* node)
 	int rv;
 	BTreeNode *mem_node = (BTreeNode*)get_block(disk, node->block_number);
 	
+	btree_write_begin();
+	btree_node_write_lock(mem_node);
+	node->version = mem_node->version;
 	void *ptr = memcpy((char*)mem_node, (char*)node, sizeof(BTreeNode));
+	btree_write_end(disk);
 	
 	rv = (ptr==NULL) ? -1 : 0;
 	
@@ -62,10 +147,10 @@ uint64_t btree_search(DiskInterface* disk, uint64_t node_block, uint64_t key)
 	
 	if (node->is_leaf) {
 		if (node->key == key) {
-			printf("Found key!\n");
+			BTREE_LOG("Found key!\n");
 			return node->block_number;
 		} else {
-			printf("Did not find key!\n");
+			BTREE_LOG("Did not find key!\n");
 			return -1;
 		}
 	} else {
@@ -77,11 +162,115 @@ uint64_t btree_search(DiskInterface* disk, uint64_t node_block, uint64_t key)
 				}
 			}
 		}
-		printf("Did not find key!\n");
+		BTREE_LOG("Did not find key!\n");
 		return -1;
 	}
 }
 
+// Newest buffered update for key: 1 for an insert, 0 for a delete, -1 if none
+int btree_buffer_probe(BTreeNode* node, uint64_t key)
+{
+	int rv;
+	uint64_t version;
+	
+	do {
+		version = btree_node_read_version(node);
+		rv = -1;
+		int num_msgs = node->num_msgs;
+		if (num_msgs > MSG_BUFFER_SIZE) num_msgs = MSG_BUFFER_SIZE;
+		for (int i = num_msgs - 1; i >= 0; i--) {
+			if (node->msgs[i].key == key) {
+				rv = (node->msgs[i].op == BTREE_MSG_INSERT);
+				break;
+			}
+		}
+	} while (!btree_node_validate(node, version));
+	
+	return rv;
+}
+
+uint64_t btree_lookup(DiskInterface* disk, uint64_t root_block, uint64_t key, BTreeAccessPath path)
+{
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
+	
+	if (root->num_msgs != 0) {
+		int pending = btree_buffer_probe(root, key);
+		if (pending == 1) {
+			BTREE_LOG("Found key!\n");
+			return BTREE_BUFFERED;
+		} else if (pending == 0) {
+			BTREE_LOG("Did not find key!\n");
+			return -1;
+		}
+	}
+	
+	if (path == BTREE_ACCESS_HASH && root->hash_index != 0) {
+		uint64_t result = hash_index_lookup(disk, root->hash_index, key);
+		if (result != -1) {
+			BTREE_LOG("Found key!\n");
+		} else {
+			BTREE_LOG("Did not find key!\n");
+		}
+		return result;
+	}
+	
+	if (path == BTREE_ACCESS_OPTIMISTIC) {
+		uint64_t result = btree_search_optimistic(disk, root_block, key);
+		if (result != -1) {
+			BTREE_LOG("Found key!\n");
+		} else {
+			BTREE_LOG("Did not find key!\n");
+		}
+		return result;
+	}
+	
+	return btree_search(disk, root_block, key);
+}
+
+uint64_t btree_search_olc(DiskInterface* disk, uint64_t node_block, uint64_t key)
+{
+	BTreeNode *node = (BTreeNode*)get_block(disk, node_block);
+	uint64_t version = btree_node_read_version(node);
+	
+	if (node->is_leaf) {
+		bool match = (node->key == key);
+		if (!btree_node_validate(node, version)) return OLC_RESTART;
+		return match ? node_block : -1;
+	}
+	
+	// Work on a private copy so a concurrent split cannot tear the child list
+	uint64_t children[MAX_KEYS + 1];
+	int num_keys = node->num_keys;
+	if (num_keys > MAX_KEYS) num_keys = MAX_KEYS;
+	memcpy(children, node->children, sizeof(children));
+	if (!btree_node_validate(node, version)) return OLC_RESTART;
+	
+	for (int i = 0; i <= num_keys; i++) {
+		if (children[i] != 0) {
+			uint64_t result = btree_search_olc(disk, children[i], key);
+			if (result == OLC_RESTART || !btree_node_validate(node, version)) return OLC_RESTART;
+			if (result != -1) return result;
+		}
+	}
+	
+	return -1;
+}
+
+uint64_t btree_search_optimistic(DiskInterface* disk, uint64_t root_block, uint64_t key)
+{
+	uint64_t result;
+	
+	epoch_enter();
+	do {
+		result = btree_search_olc(disk, root_block, key);
+	} while (result == OLC_RESTART);
+	epoch_exit();
+	// The last reader out may be the one holding pages back
+	epoch_try_collect(disk);
+	
+	return result;
+}
+
 int btree_find_depth(DiskInterface* disk, uint64_t node_block)
 {
 	BTreeNode *node = (BTreeNode*)get_block(disk, node_block);
@@ -141,6 +330,8 @@ int btree_insert_nonfull(DiskInterface* disk, BTreeNode *root, BTreeNode *node)
 		return -1;
 	} else {
 		int i;
+		btree_write_begin();
+		btree_node_write_lock(root);
 		for(i=0; i<root->num_keys && root->keys[i] < node->key; i++);
 		
 		for(int j=root->num_keys; j>i; j--) {
@@ -152,9 +343,10 @@ int btree_insert_nonfull(DiskInterface* disk, BTreeNode *root, BTreeNode *node)
 		root->children[i+1] = node->block_number;
 		node->parent = root->block_number;
 		root->num_keys++;
+		btree_write_end(disk);
 		
-		printf("Placing node with key %lu at position %d\n", node->key, i);
-		printf("Block number = %lu\n", node->block_number);
+		BTREE_LOG("Placing node with key %lu at position %d\n", node->key, i);
+		BTREE_LOG("Block number = %lu\n", node->block_number);
 	}
 	
 	return 0;
@@ -182,6 +374,7 @@ void btree_update_parent_keys(DiskInterface* disk, BTreeNode* node)
 {
 	BTreeNode *current = node;
 	
+	btree_write_begin();
 	while (current->parent != 0) {
 		BTreeNode *parent = (BTreeNode*)get_block(disk, current->parent);
 		
@@ -196,27 +389,40 @@ void btree_update_parent_keys(DiskInterface* disk, BTreeNode* node)
 		if (child_index == -1) break;
 		
 		if (child_index > 0) {
+			btree_node_write_lock(parent);
 			uint64_t max_key = btree_find_maximum(disk, current->block_number);
 			parent->keys[child_index - 1] = max_key;
 		}
 		
 		current = parent;
 	}
+	btree_write_end(disk);
 }
 
-int btree_insert(DiskInterface* disk, uint64_t root_block, uint64_t key)
+int btree_apply_insert(DiskInterface* disk, uint64_t root_block, uint64_t key)
 {
 	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
 	BTreeNode *node = btree_node_create(disk, true);
 	node->key = key;
 	
+	btree_write_begin();
+	
+	// An index missing keys would answer with false negatives, so drop it instead
+	if (root->hash_index != 0 &&
+	    hash_index_insert(disk, root->hash_index, key, node->block_number) != 0) {
+		printf("ERROR: Hash index is full, falling back to the tree\n");
+		btree_drop_hash_index(disk, root_block);
+	}
+	
 	if (root->is_leaf && root->num_keys == 0) {
+		btree_node_write_lock(root);
 		root->keys[0] = key;
 		root->children[0] = node->block_number;
 		node->parent = root->block_number;
 		root->num_keys++;
-		printf("Placing node with key %lu at position 0\n", key);
-		printf("Block number = %lu\n", node->block_number);
+		BTREE_LOG("Placing node with key %lu at position 0\n", key);
+		BTREE_LOG("Block number = %lu\n", node->block_number);
+		btree_write_end(disk);
 		return 0;
 	}
 	
@@ -225,6 +431,7 @@ int btree_insert(DiskInterface* disk, uint64_t root_block, uint64_t key)
 	}
 	
 	btree_insert_nonfull(disk, root, node);
+	btree_write_end(disk);
 	
 	return 0;
 }
@@ -237,60 +444,216 @@ int btree_borrow_right(DiskInterface* disk, uint64_t root_block, int index)
 {
 }
 
-void btree_remove_key(DiskInterface* disk, uint64_t root_block, uint64_t key)
+// Unlink a leaf and its separator from the parent; matched by block since keys may repeat
+void btree_remove_key(DiskInterface* disk, uint64_t root_block, uint64_t leaf_block)
 {
 	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
 	int i;
-	for(i=0; i<MAX_KEYS && root->keys[i] < key && root->keys[i]!=0; i++);
-	printf("i=%d\n", i);
-	printf("root->keys[i]=%d\n", root->keys[i]);
-	printf("key=%d\n", key);
-	// TODO: Merge children if num_keys < MIN_KEYS
-	/*if (root->keys[i] == key)
-	{
-		printf("Removing key %ld from block %ld\n", key, root_block);
-		for(int j=i; j<root->num_keys-1; j++)
-		{
+	
+	for (i = 0; i <= root->num_keys && root->children[i] != leaf_block; i++);
+	if (i > root->num_keys) return;
+	
+	btree_write_begin();
+	btree_node_write_lock(root);
+	if (root->num_keys == 0) {
+		root->children[0] = 0;
+	} else {
+		// Child i follows separator i-1, except child 0 which precedes separator 0
+		for (int j = (i > 0) ? i - 1 : 0; j < root->num_keys - 1; j++) {
 			root->keys[j] = root->keys[j+1];
-			root->children[j+1] = root->children[j+2];
+		}
+		for (int j = i; j < root->num_keys; j++) {
+			root->children[j] = root->children[j+1];
 		}
 		root->keys[root->num_keys-1] = 0;
 		root->children[root->num_keys] = 0;
 		root->num_keys--;
-		if (root->num_keys==0)
-		{
-			root->keys[0] = btree_find_minimum(disk, root_block);
-			root->num_keys++;
-		}
-		if (root->parent != 0)
-		{
-			btree_remove_key(disk, root->parent, key);
-		}
-	}*/
-	
-	return;
+		// TODO: Merge children if num_keys < MIN_KEYS
+	}
+	btree_write_end(disk);
 }
 
-int btree_delete(DiskInterface* disk, uint64_t root_block, uint64_t key)
+int btree_apply_delete(DiskInterface* disk, uint64_t root_block, uint64_t key)
 {
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
 	int rv = btree_search(disk, root_block, key);
 	BTreeNode *node;
 	
 	if (rv!=-1)
 	{
 		node = (BTreeNode*)get_block(disk, rv);
+		btree_write_begin();
+		btree_remove_key(disk, node->parent, node->block_number);
+		
+		// A key inserted twice keeps its entry, pointed at the leaf that remains
+		if (root->hash_index != 0) {
+			uint64_t other = btree_search(disk, root_block, key);
+			if (other != -1) {
+				hash_index_insert(disk, root->hash_index, key, other);
+			} else {
+				hash_index_delete(disk, root->hash_index, key);
+			}
+		}
 		btree_node_free(disk, node);
-		btree_remove_key(disk, node->parent, key);
+		btree_write_end(disk);
 	}
 	
 	return rv;
 }
 
+// Stable sort by key: updates to the same key keep their arrival order
+static void btree_buffer_sort(BTreeMessage* msgs, int count)
+{
+	for (int i = 1; i < count; i++) {
+		BTreeMessage msg = msgs[i];
+		int j;
+		for (j = i; j > 0 && msgs[j - 1].key > msg.key; j--) {
+			msgs[j] = msgs[j - 1];
+		}
+		msgs[j] = msg;
+	}
+}
+
+// Newest pending update of each key, sorted by key; returns how many
+int btree_buffer_net(BTreeNode* root, BTreeMessage* net)
+{
+	int count;
+	uint64_t version;
+	
+	do {
+		version = btree_node_read_version(root);
+		count = root->num_msgs;
+		if (count > MSG_BUFFER_SIZE) count = MSG_BUFFER_SIZE;
+		memcpy(net, root->msgs, count * sizeof(BTreeMessage));
+	} while (!btree_node_validate(root, version));
+	
+	btree_buffer_sort(net, count);
+	
+	// Only the newest update to each key decides whether it exists
+	int kept = 0;
+	for (int i = 0; i < count; i++) {
+		if (kept > 0 && net[kept - 1].key == net[i].key) {
+			net[kept - 1] = net[i];
+		} else {
+			net[kept++] = net[i];
+		}
+	}
+	
+	return kept;
+}
+
+const BTreeMessage* btree_buffer_find(const BTreeMessage* net, int count, uint64_t key)
+{
+	int lo = 0, hi = count - 1;
+	
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (net[mid].key == key) return &net[mid];
+		if (net[mid].key < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	
+	return NULL;
+}
+
+void btree_flush_buffer(DiskInterface* disk, uint64_t root_block)
+{
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
+	BTreeMessage batch[MSG_BUFFER_SIZE];
+	int count = root->num_msgs;
+	
+	if (count == 0) return;
+	memcpy(batch, root->msgs, count * sizeof(BTreeMessage));
+	btree_buffer_sort(batch, count);
+	
+	for (int i = 0; i < count; i++) {
+		// An insert immediately deleted again never needs to touch the tree
+		if (batch[i].op == BTREE_MSG_INSERT && i + 1 < count &&
+		    batch[i + 1].key == batch[i].key && batch[i + 1].op == BTREE_MSG_DELETE) {
+			i++;
+			continue;
+		}
+		if (batch[i].op == BTREE_MSG_INSERT) {
+			btree_apply_insert(disk, root_block, batch[i].key);
+		} else {
+			btree_apply_delete(disk, root_block, batch[i].key);
+		}
+	}
+	
+	// Cleared only now so lookups see every update either buffered or applied
+	btree_write_begin();
+	btree_node_write_lock(root);
+	root->num_msgs = 0;
+	btree_write_end(disk);
+}
+
+int btree_buffer_message(DiskInterface* disk, uint64_t root_block, uint64_t key, uint8_t op)
+{
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
+	
+	btree_write_begin();
+	btree_node_write_lock(root);
+	root->msgs[root->num_msgs].key = key;
+	root->msgs[root->num_msgs].op = op;
+	root->num_msgs++;
+	btree_write_end(disk);
+	
+	if (root->num_msgs == MSG_BUFFER_SIZE) {
+		btree_flush_buffer(disk, root_block);
+	}
+	
+	return 0;
+}
+
+int btree_insert(DiskInterface* disk, uint64_t root_block, uint64_t key)
+{
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
+	
+	if (root->buffered) {
+		return btree_buffer_message(disk, root_block, key, BTREE_MSG_INSERT);
+	}
+	
+	return btree_apply_insert(disk, root_block, key);
+}
+
+int btree_delete(DiskInterface* disk, uint64_t root_block, uint64_t key)
+{
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
+	
+	if (root->buffered) {
+		// Keep the unbuffered contract: deleting a missing key fails
+		int pending = btree_buffer_probe(root, key);
+		if (pending == 0 || (pending == -1 && btree_search(disk, root_block, key) == -1)) {
+			return -1;
+		}
+		return btree_buffer_message(disk, root_block, key, BTREE_MSG_DELETE);
+	}
+	
+	return btree_apply_delete(disk, root_block, key);
+}
+
+int btree_set_buffered(DiskInterface* disk, uint64_t root_block, bool enabled)
+{
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
+	
+	if (!enabled) {
+		btree_flush_buffer(disk, root_block);
+	}
+	root->buffered = enabled;
+	
+	return 0;
+}
+
 void btree_split_root(DiskInterface* disk, BTreeNode* root)
 {
 	BTreeNode *child_a = btree_node_create(disk, false);
 	BTreeNode *child_b = btree_node_create(disk, false);
 	
+	btree_write_begin();
+	btree_node_write_lock(root);
 	uint64_t promoted_key = root->keys[MIN_KEYS];
 	
 	for (int i = 0; i < MIN_KEYS; i++) {
@@ -339,6 +702,7 @@ void btree_split_root(DiskInterface* disk, BTreeNode* root)
 	
 	child_a->parent = root->block_number;
 	child_b->parent = root->block_number;
+	btree_write_end(disk);
 }
 
 void btree_split_node(DiskInterface* disk, BTreeNode* node, int index, BTreeNode* child)
@@ -346,6 +710,10 @@ void btree_split_node(DiskInterface* disk, BTreeNode* node, int index, BTreeNode
 	BTreeNode *child_b = btree_node_create(disk, child->is_leaf);
 	child_b->parent = node->block_number;
 	
+	btree_write_begin();
+	btree_node_write_lock(node);
+	btree_node_write_lock(child);
+	
 	uint64_t promoted_key = child->keys[MIN_KEYS];
 	
 	for (int i = MIN_KEYS + 1; i < child->num_keys; i++) {
@@ -394,6 +762,7 @@ void btree_split_node(DiskInterface* disk, BTreeNode* node, int index, BTreeNode
 			btree_split_node(disk, grandparent, parent_index, node);
 			
 			BTreeNode *current_parent = (BTreeNode*)get_block(disk, child->parent);
+			btree_node_write_lock(current_parent);
 			int new_index;
 			for (new_index = 0; new_index <= current_parent->num_keys; new_index++) {
 				if (current_parent->children[new_index] == child->block_number) break;
@@ -428,6 +797,7 @@ void btree_split_node(DiskInterface* disk, BTreeNode* node, int index, BTreeNode
 			btree_update_parent_keys(disk, child_b);
 		}
 	}
+	btree_write_end(disk);
 }
 
 void btree_merge_children(DiskInterface* disk, BTreeNode* parent, int index)
@@ -435,6 +805,9 @@ void btree_merge_children(DiskInterface* disk, BTreeNode* parent, int index)
 	BTreeNode *child_a = (BTreeNode*)get_block(disk, parent->children[index]);
 	BTreeNode *child_b = (BTreeNode*)get_block(disk, parent->children[index+1]);
 	
+	btree_write_begin();
+	btree_node_write_lock(parent);
+	btree_node_write_lock(child_a);
 	// TODO: Should we delete keys first and then worry about borrow/merge, or should we borrow/merge first, then worry about deletion?
 	for (int i = MIN_KEYS + 1; i < MAX_KEYS; i++) {
 		child_a->keys[i] = child_b->keys[i - MIN_KEYS - 1];
@@ -457,11 +830,341 @@ void btree_merge_children(DiskInterface* disk, BTreeNode* parent, int index)
 	
 	btree_update_parent_keys(disk, child_a);
 	btree_node_free(disk, child_b);
+	btree_write_end(disk);
+}
+
+int btree_index_leaves(DiskInterface* disk, uint64_t node_block, uint64_t dir_block)
+{
+	BTreeNode *node = (BTreeNode*)get_block(disk, node_block);
+	
+	if (node->is_leaf) {
+		return hash_index_insert(disk, dir_block, node->key, node->block_number);
+	}
+	
+	for (int i = 0; i <= node->num_keys; i++) {
+		if (node->children[i] != 0 &&
+		    btree_index_leaves(disk, node->children[i], dir_block) != 0) {
+			return -1;
+		}
+	}
+	
+	return 0;
+}
+
+// Secondary hash index
+int btree_build_hash_index(DiskInterface* disk, uint64_t root_block)
+{
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
+	
+	if (root->hash_index != 0) return 0;
+	
+	uint64_t dir_block = hash_index_create(disk);
+	if (dir_block == 0) {
+		printf("ERROR: Could not allocate hash index\n");
+		return -1;
+	}
+	
+	if (btree_index_leaves(disk, root_block, dir_block) != 0) {
+		printf("ERROR: Tree has too many keys for the hash index\n");
+		hash_index_destroy(disk, dir_block);
+		return -1;
+	}
+	root->hash_index = dir_block;
+	
+	return 0;
+}
+
+void btree_drop_hash_index(DiskInterface* disk, uint64_t root_block)
+{
+	BTreeNode *root = (BTreeNode*)get_block(disk, root_block);
+	
+	if (root->hash_index == 0) return;
+	
+	hash_index_destroy(disk, root->hash_index);
+	root->hash_index = 0;
+}
+
+// Pending updates of a buffered root, merged into whole-tree reads instead of flushing
+typedef struct BufferMerge {
+	BTreeMessage net[MSG_BUFFER_SIZE];
+	int count;
+	int pos;			// Next buffered update not yet passed by the read
+} BufferMerge;
+
+static void btree_merge_begin(DiskInterface* disk, uint64_t root_block, BufferMerge* m)
+{
+	m->count = btree_buffer_net((BTreeNode*)get_block(disk, root_block), m->net);
+	m->pos = 0;
+}
+
+// Report buffered inserts in [lo, hi] that sort before key, or all that remain if last
+static uint64_t btree_merge_pending(BufferMerge* m, uint64_t key, bool last, uint64_t lo, uint64_t hi, void (*callback)(uint64_t key, uint64_t value))
+{
+	uint64_t reported = 0;
+	
+	for (; m->pos < m->count && (last || m->net[m->pos].key < key); m->pos++) {
+		BTreeMessage *msg = &m->net[m->pos];
+		if (msg->op != BTREE_MSG_INSERT || msg->key < lo || msg->key > hi) continue;
+		if (callback != NULL) callback(msg->key, 0);
+		reported++;
+	}
+	
+	return reported;
+}
+
+static void btree_traverse_node(DiskInterface* disk, uint64_t node_block, BufferMerge* m, void (*callback)(uint64_t key, uint64_t value))
+{
+	BTreeNode *node = (BTreeNode*)get_block(disk, node_block);
+	
+	if (node->is_leaf) {
+		btree_merge_pending(m, node->key, false, 0, UINT64_MAX, callback);
+		// A leaf with a pending update is reported (or not) by the buffer instead
+		if (btree_buffer_find(m->net, m->count, node->key) == NULL) {
+			callback(node->key, node->value);
+		}
+		return;
+	}
+	
+	for (int i = 0; i <= node->num_keys; i++) {
+		if (node->children[i] != 0) {
+			btree_traverse_node(disk, node->children[i], m, callback);
+		}
+	}
 }
 
 // B-tree traversal and debugging
 void btree_traverse(DiskInterface* disk, uint64_t root_block, void (*callback)(uint64_t key, uint64_t value))
 {
+	BufferMerge m;
+	
+	btree_merge_begin(disk, root_block, &m);
+	btree_traverse_node(disk, root_block, &m, callback);
+	btree_merge_pending(&m, 0, true, 0, UINT64_MAX, callback);
+}
+
+// Explicit DFS stack; the scan keeps two, one for the cursor and one running ahead of it
+typedef struct ScanEntry {
+	uint64_t block;
+	uint64_t parent;	// Node that pushed it; entries sharing one are siblings
+	uint64_t hinted;	// Refill pass that hinted the block, 0 if not yet hinted
+} ScanEntry;
+
+typedef struct ScanCursor {
+	ScanEntry *entries;
+	int top;
+	int capacity;
+} ScanCursor;
+
+// The lookahead walks the scan's DFS order without reading a block until a
+// pass after the one that hinted it. Blocks on its stack are unread; `nodes`
+// counts the ones it has read, so nodes - (scan's nodes) are read and waiting.
+typedef struct ScanLookahead {
+	ScanCursor stack;
+	uint64_t nodes;
+	uint64_t pass;
+} ScanLookahead;
+
+// Adjacent hinted blocks are coalesced into one madvise request
+typedef struct ScanHints {
+	uint64_t start;
+	uint64_t len;
+} ScanHints;
+
+static bool scan_cursor_push(ScanCursor* c, uint64_t block, uint64_t parent)
+{
+	if (c->top == c->capacity) {
+		int capacity = c->capacity ? c->capacity * 2 : 64;
+		ScanEntry *entries = (ScanEntry*)realloc(c->entries, capacity * sizeof(ScanEntry));
+		if (entries == NULL) return false;
+		c->entries = entries;
+		c->capacity = capacity;
+	}
+	c->entries[c->top].block = block;
+	c->entries[c->top].parent = parent;
+	c->entries[c->top].hinted = 0;
+	c->top++;
+	return true;
+}
+
+// Children go on in reverse so they come off in key order
+static bool scan_cursor_expand(ScanCursor* c, BTreeNode* node)
+{
+	for (int i = node->num_keys; i >= 0; i--) {
+		if (node->children[i] != 0 && !scan_cursor_push(c, node->children[i], node->block_number)) return false;
+	}
+	return true;
+}
+
+static void scan_hint_flush(DiskInterface* disk, ScanHints* hints, BTreeScanStats* stats)
+{
+	if (hints->len == 0) return;
+	disk_prefetch(disk, hints->start, hints->len);
+	stats->prefetch_calls++;
+	stats->prefetch_blocks += hints->len;
+	hints->len = 0;
+}
+
+static void scan_hint(DiskInterface* disk, ScanHints* hints, uint64_t block, BTreeScanStats* stats)
+{
+	if (hints->len != 0 && block == hints->start + hints->len) {
+		hints->len++;
+		return;
+	}
+	scan_hint_flush(disk, hints, stats);
+	hints->start = block;
+	hints->len = 1;
+}
+
+// Siblings at the top of the stack are the next blocks in DFS order; entries
+// below them wait behind whole subtrees, so only the top group is counted
+static int scan_group_start(ScanCursor* c)
+{
+	int i = c->top - 1;
+	if (i < 0) return 0;
+	while (i > 0 && c->entries[i - 1].parent == c->entries[c->top - 1].parent) i--;
+	return i;
+}
+
+// Blocks read ahead of the scan plus hinted blocks in the top sibling group
+static uint64_t scan_in_flight(ScanLookahead* la, uint64_t scanned)
+{
+	uint64_t in_flight = la->nodes - scanned;
+	int group = scan_group_start(&la->stack);
+	
+	for (int i = la->stack.top - 1; i >= group; i--) {
+		if (la->stack.entries[i].hinted != 0) in_flight++;
+	}
+	return in_flight;
+}
+
+// One refill pass: hint the top sibling group of the lookahead stack until
+// `target` blocks are in flight. Only blocks hinted by an earlier pass are
+// read and expanded, so every hint has at least one scan step to land before
+// its page is touched; a pass stops at the first block it hinted itself.
+static bool btree_scan_prefetch(DiskInterface* disk, ScanLookahead* la, uint64_t scanned, uint64_t target, BTreeScanStats* stats)
+{
+	ScanHints hints = { 0, 0 };
+	bool ok = true;
+	
+	la->pass++;
+	while (ok) {
+		uint64_t in_flight = scan_in_flight(la, scanned);
+		int group = scan_group_start(&la->stack);
+		for (int i = la->stack.top - 1; i >= group && in_flight < target; i--) {
+			ScanEntry *entry = &la->stack.entries[i];
+			if (entry->hinted != 0) continue;
+			entry->hinted = la->pass;
+			in_flight++;
+			scan_hint(disk, &hints, entry->block, stats);
+		}
+		if (in_flight >= target || la->stack.top == 0) break;
+		
+		ScanEntry *entry = &la->stack.entries[la->stack.top - 1];
+		if (entry->hinted == la->pass) break;
+		
+		BTreeNode *node = (BTreeNode*)get_block(disk, entry->block);
+		int popped = --la->stack.top;
+		la->nodes++;
+		if (!node->is_leaf) ok = scan_cursor_expand(&la->stack, node);
+		if (la->stack.top == popped && scan_in_flight(la, scanned) > target) {
+			// Nothing was pushed, so the group underneath, hinted earlier, would overfill the window
+			la->stack.top++;
+			la->nodes--;
+			break;
+		}
+	}
+	scan_hint_flush(disk, &hints, stats);
+	return ok;
+}
+
+int64_t btree_scan(DiskInterface* disk, uint64_t root_block, uint64_t lo, uint64_t hi, void (*callback)(uint64_t key, uint64_t value), const BTreeScanOptions* opts, BTreeScanStats* stats)
+{
+	BTreeScanOptions defaults = { 0, 0, false };
+	BTreeScanStats local;
+	struct timespec start, end;
+	uint64_t last_leaf = 0;
+	int64_t rv = 0;
+	
+	if (opts == NULL) opts = &defaults;
+	if (stats == NULL) stats = &local;
+	memset(stats, 0, sizeof(BTreeScanStats));
+	
+	int window = opts->window;
+	int max_window = opts->max_window;
+	if (max_window <= 0) max_window = opts->adaptive ? SCAN_MAX_WINDOW : window;
+	if (max_window < window) max_window = window;
+	
+	BufferMerge m;
+	btree_merge_begin(disk, root_block, &m);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	
+	// Both walk the same DFS order; the lookahead keeps up to `window` blocks in flight
+	ScanCursor cursor = { NULL, 0, 0 };
+	ScanLookahead la = { { NULL, 0, 0 }, 0, 0 };
+	if (!scan_cursor_push(&cursor, root_block, 0) || !scan_cursor_push(&la.stack, root_block, 0)) {
+		rv = -1;
+	}
+	
+	while (rv == 0 && cursor.top > 0) {
+		if (window > 0 && scan_in_flight(&la, stats->nodes) < (uint64_t)window) {
+			if (!btree_scan_prefetch(disk, &la, stats->nodes, window, stats)) {
+				rv = -1;
+				break;
+			}
+			uint64_t in_flight = scan_in_flight(&la, stats->nodes);
+			if (in_flight > stats->max_ahead) stats->max_ahead = in_flight;
+		}
+		
+		uint64_t block = cursor.entries[--cursor.top].block;
+		BTreeNode *node = (BTreeNode*)get_block(disk, block);
+		stats->nodes++;
+		
+		// The scan reached the lookahead's next block; step the lookahead past it too
+		if (la.nodes < stats->nodes) {
+			la.stack.top--;
+			la.nodes++;
+			if (!node->is_leaf && !scan_cursor_expand(&la.stack, node)) {
+				rv = -1;
+				break;
+			}
+		}
+		
+		if (node->is_leaf) {
+			// Adaptive readahead: widen while leaves sit on consecutive blocks
+			if (opts->adaptive && last_leaf != 0) {
+				if (block == last_leaf + 1) {
+					window = window ? window * 2 : 1;
+					if (window > max_window) window = max_window;
+				} else {
+					window /= 2;
+				}
+			}
+			last_leaf = block;
+			
+			stats->matches += btree_merge_pending(&m, node->key, false, lo, hi, callback);
+			if (node->key >= lo && node->key <= hi &&
+			    btree_buffer_find(m.net, m.count, node->key) == NULL) {
+				if (callback != NULL) callback(node->key, node->value);
+				stats->matches++;
+			}
+			continue;
+		}
+		
+		if (!scan_cursor_expand(&cursor, node)) rv = -1;
+	}
+	free(cursor.entries);
+	free(la.stack.entries);
+	if (rv != 0) return rv;
+	stats->matches += btree_merge_pending(&m, 0, true, lo, hi, callback);
+	
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats->final_window = window;
+	stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (stats->seconds > 0) {
+		stats->mb_per_sec = stats->nodes * BLOCK_SIZE / stats->seconds / (1024.0 * 1024.0);
+	}
+	
+	return stats->matches;
 }
 
 void btree_validate(DiskInterface* disk, uint64_t root_block)
@@ -486,7 +1189,9 @@ void btree_print(DiskInterface* disk, uint64_t root_block, int level)
 			printf("%lu", node->children[i]);
 			if (i < node->num_keys) printf(",");
 		}
-		printf("]\n");
+		printf("]");
+		if (node->num_msgs != 0) printf(" msgs=%u", node->num_msgs);
+		printf("\n");
 		
 		// Recursively print children
 		for(int i = 0; i <= node->num_keys; i++) {
@@ -497,6 +1202,7 @@ void btree_print(DiskInterface* disk, uint64_t root_block, int level)
 	}
 }
 
+#ifndef BTREE_NO_MAIN
 int main()
 {
 	DiskInterface* disk = disk_open("my.img");
@@ -504,7 +1210,7 @@ int main()
 	BTreeNode *root = btree_node_create(disk, false);
 	
 	while (true) {
-		printf("Select 1 to insert a key, and 2 to search for a key, and 3 for debug print: ");
+		printf("Select 1 to insert a key, and 2 to search for a key, and 3 for debug print, 5 to build the hash index, 6 for a hash lookup: ");
 		int choice, key;
 		scanf("%d", &choice);
 		switch (choice) {
@@ -516,13 +1222,22 @@ int main()
 			case 2:
 				printf("Key to search: ");
 				scanf("%d", &key);
-				btree_search(disk, root->block_number, key);
+				btree_lookup(disk, root->block_number, key, BTREE_ACCESS_TREE);
 				break;
 			case 3:
 				btree_print(disk, root->block_number, 1);
 				break;
+			case 5:
+				btree_build_hash_index(disk, root->block_number);
+				break;
+			case 6:
+				printf("Key to search: ");
+				scanf("%d", &key);
+				btree_lookup(disk, root->block_number, key, BTREE_ACCESS_HASH);
+				break;
 			default:
 				return 0;
 		}
 	}
 }
+#endif
@@ -5,6 +5,15 @@
 #include "config.h"
 #include "disk.h"
 
+// Buffered update kinds (write-optimized mode)
+#define BTREE_MSG_INSERT 1
+#define BTREE_MSG_DELETE 2
+
+typedef struct BTreeMessage {
+    uint64_t key;			// Key the update applies to
+    uint8_t op;				// BTREE_MSG_INSERT or BTREE_MSG_DELETE
+} BTreeMessage;
+
 // B-tree node structure
 typedef struct BTreeNode {
     uint64_t block_number;		// Physical block number on disk
@@ -15,8 +24,41 @@ typedef struct BTreeNode {
     uint64_t keys[MAX_KEYS];		// Array of keys (could be inode numbers)
     uint64_t children[MAX_KEYS + 1];	// Array of child block numbers
     uint64_t parent;			// Parent node block number
+    uint64_t hash_index;		// Hash index directory block (root only, 0 if none)
+    uint64_t version;			// Optimistic lock word, odd while a writer holds the node
+    bool buffered;			// Write-optimized mode (root only): updates queue in msgs[]
+    uint16_t num_msgs;			// Number of buffered updates
+    BTreeMessage msgs[MSG_BUFFER_SIZE];	// Buffered updates, oldest first
 } BTreeNode;
 
+_Static_assert(sizeof(BTreeNode) <= BLOCK_SIZE, "BTreeNode must fit in one block");
+
+// Access path used to answer a point lookup
+typedef enum BTreeAccessPath {
+    BTREE_ACCESS_TREE,			// Descend the B-tree
+    BTREE_ACCESS_HASH,			// Exact match through the hash index, or the tree if the root has none
+    BTREE_ACCESS_OPTIMISTIC,		// Latch-free descent validated by node versions
+} BTreeAccessPath;
+
+// Range scan tuning
+typedef struct BTreeScanOptions {
+    int window;				// Blocks to keep hinted ahead of the scan (0 disables)
+    int max_window;			// Upper bound for the adaptive window
+    bool adaptive;			// Grow the window on sequential leaves, shrink otherwise
+} BTreeScanOptions;
+
+// Range scan statistics
+typedef struct BTreeScanStats {
+    uint64_t nodes;			// Pages visited
+    uint64_t matches;			// Leaves reported to the callback
+    uint64_t prefetch_calls;		// madvise requests issued
+    uint64_t prefetch_blocks;		// Blocks covered by those requests
+    uint64_t max_ahead;			// Most blocks in flight ahead of the scan
+    int final_window;			// Window in effect when the scan ended
+    double seconds;			// Wall time of the scan
+    double mb_per_sec;			// Pages visited per second, in MiB
+} BTreeScanStats;
+
 // ==================== B-TREE OPERATIONS ====================
 
 // B-tree core operations
@@ -25,14 +67,41 @@ void btree_node_free(DiskInterface* disk, BTreeNode* node);
 int btree_node_read(DiskInterface* disk, uint64_t block_num, BTreeNode* node);
 int btree_node_write(DiskInterface* disk, BTreeNode* node);
 uint64_t btree_search(DiskInterface* disk, uint64_t root_block, uint64_t key);
+uint64_t btree_search_optimistic(DiskInterface* disk, uint64_t root_block, uint64_t key);
+uint64_t btree_lookup(DiskInterface* disk, uint64_t root_block, uint64_t key, BTreeAccessPath path);
 int btree_insert(DiskInterface* disk, uint64_t root_block, uint64_t key);
 int btree_delete(DiskInterface* disk, uint64_t root_block, uint64_t key);
 void btree_split_root(DiskInterface* disk, BTreeNode* root);
 void btree_split_node(DiskInterface* disk, BTreeNode* node, int index, BTreeNode* child);
 void btree_merge_children(DiskInterface* disk, BTreeNode* parent, int index);
 
+// Write-optimized mode: inserts and deletes are appended to the root's
+// message buffer and applied as a key-sorted batch when it fills. Queued
+// inserts and deletes both return 0 (block 0 is never a leaf); deleting a
+// missing key still returns -1. A point lookup that hits a buffered insert
+// has no leaf yet and returns BTREE_BUFFERED. Whole-tree reads never flush:
+// they merge the pending updates into what they report, so a key with one
+// is reported at most once.
+#define BTREE_BUFFERED (-3)
+
+int btree_set_buffered(DiskInterface* disk, uint64_t root_block, bool enabled);
+void btree_flush_buffer(DiskInterface* disk, uint64_t root_block);
+int btree_buffer_net(BTreeNode* root, BTreeMessage* net);
+const BTreeMessage* btree_buffer_find(const BTreeMessage* net, int count, uint64_t key);
+
+// Optimistic lock coupling: writers are assumed to be serialized among
+// themselves. Every function above that modifies nodes locks them itself
+// and releases them before it returns.
+uint64_t btree_node_read_version(BTreeNode* node);
+bool btree_node_validate(BTreeNode* node, uint64_t version);
+
+// Secondary hash index
+int btree_build_hash_index(DiskInterface* disk, uint64_t root_block);
+void btree_drop_hash_index(DiskInterface* disk, uint64_t root_block);
+
 // B-tree traversal and debugging
 void btree_traverse(DiskInterface* disk, uint64_t root_block, void (*callback)(uint64_t key, uint64_t value));
+int64_t btree_scan(DiskInterface* disk, uint64_t root_block, uint64_t lo, uint64_t hi, void (*callback)(uint64_t key, uint64_t value), const BTreeScanOptions* opts, BTreeScanStats* stats);
 void btree_validate(DiskInterface* disk, uint64_t root_block);
 void btree_print(DiskInterface* disk, uint64_t root_block, int level);
 #endif
@@ -0,0 +1,629 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "btr.h"
+#include "disk.h"
+#include "bitmap.h"
+#include "parallel.h"
+#include "epoch.h"
+#include "shard.h"
+
+// ==================== BEHAVIOURAL CHECKS ====================
+
+#define CHECK_IMAGE "check.img"
+#define CHECK_REBUILD_IMAGE "check-rebuild.img"
+#define CHECK_EXPORT "check.out"
+#define CHECK_IMAGE_BLOCKS (BITMAP_BYTES * 8)
+
+static FILE *report;
+static int checks_run = 0;
+static int checks_failed = 0;
+
+static void check(bool ok, const char* name)
+{
+	checks_run++;
+	if (!ok) checks_failed++;
+	fprintf(report, "%s %d - %s\n", ok ? "ok" : "not ok", checks_run, name);
+}
+
+// Keys seen by btree_traverse, which has no argument to carry them
+static uint64_t *seen;
+static size_t seen_count;
+
+static DiskInterface* check_image(const char* filename)
+{
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1 || ftruncate(fd, (off_t)CHECK_IMAGE_BLOCKS * BLOCK_SIZE) != 0) {
+		fprintf(stderr, "Failed to create %s\n", filename);
+		exit(1);
+	}
+	close(fd);
+
+	return disk_open(filename);
+}
+
+static uint64_t check_tree(DiskInterface* disk)
+{
+	alloc_page(disk);
+	return btree_node_create(disk, false)->block_number;
+}
+
+// Distinct keys in shuffled order
+static uint64_t* check_keys(int count)
+{
+	uint64_t *keys = (uint64_t*)malloc(count * sizeof(uint64_t));
+
+	for (int i = 0; i < count; i++) keys[i] = (uint64_t)i * 7 + 3;
+	for (int i = count - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		uint64_t t = keys[i];
+		keys[i] = keys[j];
+		keys[j] = t;
+	}
+
+	return keys;
+}
+
+static void seen_add(uint64_t key, uint64_t value)
+{
+	seen[seen_count++] = key;
+}
+
+static int key_compare(const void* a, const void* b)
+{
+	uint64_t ka = *(const uint64_t*)a, kb = *(const uint64_t*)b;
+	return (ka > kb) - (ka < kb);
+}
+
+// Sorted keys of the whole tree, as the sequential traversal reports them
+static size_t traverse_keys(DiskInterface* disk, uint64_t root)
+{
+	seen_count = 0;
+	btree_traverse(disk, root, seen_add);
+	qsort(seen, seen_count, sizeof(uint64_t), key_compare);
+	return seen_count;
+}
+
+static void check_hash_index(void)
+{
+	DiskInterface *disk = check_image(CHECK_IMAGE);
+	uint64_t root = check_tree(disk);
+	uint64_t *keys = check_keys(600);
+	bool same = true, present = true, absent = true;
+
+	for (int i = 0; i < 400; i++) btree_insert(disk, root, keys[i]);
+	check(btree_build_hash_index(disk, root) == 0, "hash index builds over an existing tree");
+	for (int i = 0; i < 150; i++) btree_delete(disk, root, keys[i]);
+	for (int i = 400; i < 600; i++) btree_insert(disk, root, keys[i]);
+
+	for (int i = 0; i < 600; i++) {
+		uint64_t tree = btree_lookup(disk, root, keys[i], BTREE_ACCESS_TREE);
+		uint64_t hash = btree_lookup(disk, root, keys[i], BTREE_ACCESS_HASH);
+		if (tree != hash) same = false;
+		if (i < 150 && tree != (uint64_t)-1) absent = false;
+		if (i >= 150 && tree == (uint64_t)-1) present = false;
+	}
+	if (btree_lookup(disk, root, 1, BTREE_ACCESS_HASH) != (uint64_t)-1) absent = false;
+
+	check(same, "hash and tree lookups agree after inserts and deletes");
+	check(present, "live keys are found");
+	check(absent, "deleted and never-inserted keys are not found");
+
+	// A key inserted twice stays indexed until its last leaf is deleted
+	uint64_t dup = keys[300];
+	btree_insert(disk, root, dup);
+	btree_delete(disk, root, dup);
+	uint64_t tree = btree_lookup(disk, root, dup, BTREE_ACCESS_TREE);
+	check(tree != (uint64_t)-1 && btree_lookup(disk, root, dup, BTREE_ACCESS_HASH) == tree,
+	      "deleting one copy of a duplicate key leaves the index on the other");
+	btree_delete(disk, root, dup);
+	check(btree_lookup(disk, root, dup, BTREE_ACCESS_TREE) == (uint64_t)-1 &&
+	      btree_lookup(disk, root, dup, BTREE_ACCESS_HASH) == (uint64_t)-1,
+	      "deleting the last copy removes it from both");
+
+	free(keys);
+	disk_close(disk);
+}
+
+static void check_parallel(void)
+{
+	DiskInterface *disk = check_image(CHECK_IMAGE);
+	uint64_t root = check_tree(disk);
+	uint64_t *keys = check_keys(800);
+	BTreeAggregate agg;
+
+	for (int i = 0; i < 800; i++) btree_insert(disk, root, keys[i]);
+	for (int i = 0; i < 100; i++) btree_delete(disk, root, keys[i]);
+
+	size_t count = traverse_keys(disk, root);
+	uint64_t *expect = (uint64_t*)malloc(count * sizeof(uint64_t));
+	memcpy(expect, seen, count * sizeof(uint64_t));
+	check(count == 700, "sequential traversal sees every live key");
+
+	check(btree_parallel_count(disk, root, 1) == count, "parallel count with one thread matches traversal");
+	check(btree_parallel_count(disk, root, 4) == count, "parallel count with four threads matches traversal");
+	btree_parallel_aggregate(disk, root, 4, &agg);
+	check(agg.min_key == expect[0] && agg.max_key == expect[count - 1], "parallel aggregate finds the key range");
+
+	check(btree_parallel_export(disk, root, 4, CHECK_EXPORT) == (int64_t)count, "export writes one record per key");
+	BTreeRecord *recs = (BTreeRecord*)malloc(count * sizeof(BTreeRecord));
+	FILE *fp = fopen(CHECK_EXPORT, "rb");
+	size_t read = fread(recs, sizeof(BTreeRecord), count, fp);
+	fclose(fp);
+	unlink(CHECK_EXPORT);
+	bool ordered = (read == count);
+	for (size_t i = 0; ordered && i < count; i++) {
+		if (recs[i].key != expect[i]) ordered = false;
+	}
+	check(ordered, "export is the traversal's key set in ascending order");
+	free(recs);
+
+	DiskInterface *dst = check_image(CHECK_REBUILD_IMAGE);
+	uint64_t new_root;
+	check(btree_parallel_rebuild(disk, root, dst, 4, 0.75, &new_root) == 0, "rebuild succeeds");
+	bool same = (traverse_keys(dst, new_root) == count);
+	for (size_t i = 0; same && i < count; i++) {
+		if (seen[i] != expect[i]) same = false;
+	}
+	check(same, "rebuilt tree holds the same key set");
+	bool found = true;
+	for (size_t i = 0; i < count; i++) {
+		if (btree_lookup(dst, new_root, expect[i], BTREE_ACCESS_TREE) == (uint64_t)-1) found = false;
+	}
+	check(found, "every key is found in the rebuilt tree");
+	disk_close(dst);
+
+	// An indexed tree is only rebuilt when its index fits as well
+	btree_build_hash_index(disk, root);
+	bool indexed = true;
+	int rv = -1;
+	for (uint64_t blocks = count; rv != 0 && blocks < 2 * count; blocks++) {
+		dst = check_image(CHECK_REBUILD_IMAGE);
+		dst->alloc_end = blocks;
+		rv = btree_parallel_rebuild(disk, root, dst, 4, 0.75, &new_root);
+		if (rv == 0) {
+			BTreeNode *rebuilt = (BTreeNode*)get_block(dst, new_root);
+			indexed = rebuilt->hash_index != 0 &&
+			          btree_lookup(dst, new_root, expect[7], BTREE_ACCESS_HASH) ==
+			          btree_lookup(dst, new_root, expect[7], BTREE_ACCESS_TREE);
+		}
+		disk_close(dst);
+	}
+	check(rv == 0 && indexed, "smallest image a rebuild accepts also holds its hash index");
+	unlink(CHECK_REBUILD_IMAGE);
+	free(expect);
+	free(keys);
+	disk_close(disk);
+}
+
+typedef struct OlcReader {
+	DiskInterface *disk;
+	uint64_t root;
+	uint64_t *keys;
+	int count;
+	bool *done;
+	bool missed;
+	long lookups;
+} OlcReader;
+
+static void* olc_reader(void* p)
+{
+	OlcReader *r = (OlcReader*)p;
+
+	while (!__atomic_load_n(r->done, __ATOMIC_ACQUIRE) || r->lookups == 0) {
+		uint64_t key = r->keys[r->lookups % r->count];
+		if (btree_search_optimistic(r->disk, r->root, key) == (uint64_t)-1) r->missed = true;
+		r->lookups++;
+	}
+
+	return NULL;
+}
+
+static void* olc_lookup_once(void* p)
+{
+	OlcReader *r = (OlcReader*)p;
+
+	if (btree_search_optimistic(r->disk, r->root, r->keys[0]) == (uint64_t)-1) r->missed = true;
+	return NULL;
+}
+
+static void check_optimistic(void)
+{
+	DiskInterface *disk = check_image(CHECK_IMAGE);
+	uint64_t root = check_tree(disk);
+	uint64_t *keys = check_keys(2000);
+	bool done = false;
+	pthread_t threads[3];
+	OlcReader readers[3];
+
+	for (int i = 0; i < 200; i++) btree_insert(disk, root, keys[i]);
+
+	BTreeNode copy;
+	btree_node_read(disk, root, &copy);
+	btree_node_write(disk, &copy);
+	check((((BTreeNode*)get_block(disk, root))->version & 1) == 0, "btree_node_write outside an insert leaves the node unlocked");
+
+	// Readers only look up keys the writer never removes, so every lookup must hit
+	for (int i = 0; i < 3; i++) {
+		readers[i] = (OlcReader){ disk, root, keys, 100, &done, false, 0 };
+		pthread_create(&threads[i], NULL, olc_reader, &readers[i]);
+	}
+	for (int i = 200; i < 2000; i++) {
+		btree_insert(disk, root, keys[i]);
+		if (i % 3 == 0) btree_delete(disk, root, keys[i - 50]);
+	}
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+	bool missed = false;
+	for (int i = 0; i < 3; i++) {
+		pthread_join(threads[i], NULL);
+		if (readers[i].missed) missed = true;
+	}
+	check(!missed, "optimistic readers racing a writer always find stable keys");
+
+	bool agree = true;
+	for (int i = 0; i < 2000; i++) {
+		if (btree_lookup(disk, root, keys[i], BTREE_ACCESS_OPTIMISTIC) !=
+		    btree_lookup(disk, root, keys[i], BTREE_ACCESS_TREE)) agree = false;
+	}
+	check(agree, "optimistic and tree lookups agree once the writer is done");
+
+	// Epoch slots are claimed per critical section, not per thread lifetime
+	OlcReader once = { disk, root, keys, 1, &done, false, 0 };
+	for (int i = 0; i < EPOCH_MAX_THREADS + 8; i++) {
+		pthread_t t;
+		pthread_create(&t, NULL, olc_lookup_once, &once);
+		pthread_join(t, NULL);
+	}
+	check(!once.missed, "more reader threads than epoch slots can come and go");
+
+	// Hash index pages go back to the bitmap directly; as tree nodes they must start unlocked
+	btree_build_hash_index(disk, root);
+	btree_drop_hash_index(disk, root);
+	uint64_t *more = check_keys(2600);
+	bool even = true;
+	for (int i = 0; i < 600; i++) {
+		more[i] += 100000;
+		btree_insert(disk, root, more[i]);
+		BTreeNode *leaf = (BTreeNode*)get_block(disk, btree_search(disk, root, more[i]));
+		if ((leaf->version & 1) || (((BTreeNode*)get_block(disk, leaf->parent))->version & 1)) even = false;
+	}
+	for (int i = 0; i < 600; i++) btree_delete(disk, root, more[i]);
+	check(even, "nodes on reused hash index pages start unlocked");
+	free(more);
+
+	// With no reader inside, a deleted leaf is reclaimed before the delete returns
+	uint64_t leaf = btree_search(disk, root, keys[0]);
+	btree_delete(disk, root, keys[0]);
+	check(!bitmap_get(get_block_bitmap(disk), leaf), "deleted leaf is reclaimed at the end of the delete");
+
+	free(keys);
+	disk_close(disk);
+}
+
+// Sorted logical key set: keys[0..live) minus keys[0..gone)
+static bool same_keys(const uint64_t* keys, int gone, int live)
+{
+	int count = live - gone;
+	uint64_t *expect = (uint64_t*)malloc(count * sizeof(uint64_t));
+
+	memcpy(expect, keys + gone, count * sizeof(uint64_t));
+	qsort(expect, count, sizeof(uint64_t), key_compare);
+	bool same = (seen_count == (size_t)count);
+	for (int i = 0; same && i < count; i++) {
+		if (seen[i] != expect[i]) same = false;
+	}
+
+	free(expect);
+	return same;
+}
+
+static void check_buffered(void)
+{
+	DiskInterface *disk = check_image(CHECK_IMAGE);
+	uint64_t root = check_tree(disk);
+	uint64_t *keys = check_keys(140);
+	BTreeNode *node = (BTreeNode*)get_block(disk, root);
+
+	// keys[0..20) are deleted through the buffer, keys[100..140) inserted through it
+	for (int i = 0; i < 100; i++) btree_insert(disk, root, keys[i]);
+	btree_set_buffered(disk, root, true);
+	bool queued = true;
+	for (int i = 100; i < 140; i++) {
+		if (btree_insert(disk, root, keys[i]) != 0) queued = false;
+	}
+	for (int i = 0; i < 20; i++) {
+		if (btree_delete(disk, root, keys[i]) != 0) queued = false;
+	}
+	check(queued, "buffered delete of a live key is queued and returns 0, like a buffered insert");
+	check(btree_delete(disk, root, keys[0]) == -1, "buffered delete of a key deleted in the buffer fails");
+	check(btree_delete(disk, root, 1) == -1, "buffered delete of a missing key fails");
+	check(node->num_msgs == 60, "updates are still buffered");
+
+	check(btree_lookup(disk, root, keys[120], BTREE_ACCESS_TREE) == BTREE_BUFFERED, "lookup of a buffered insert returns BTREE_BUFFERED");
+	check(btree_lookup(disk, root, keys[10], BTREE_ACCESS_TREE) == (uint64_t)-1, "lookup of a buffered delete misses");
+	uint64_t hit = btree_lookup(disk, root, keys[50], BTREE_ACCESS_TREE);
+	check(hit != (uint64_t)-1 && hit != BTREE_BUFFERED && ((BTreeNode*)get_block(disk, hit))->key == keys[50],
+	      "lookup of an untouched key returns its leaf");
+
+	traverse_keys(disk, root);
+	check(same_keys(keys, 20, 140), "traversal merges buffered inserts and deletes");
+	check(btree_parallel_count(disk, root, 4) == 120, "parallel count merges buffered updates");
+	uint64_t lo = keys[130] < keys[60] ? keys[130] : keys[60];
+	uint64_t hi = keys[130] < keys[60] ? keys[60] : keys[130];
+	uint64_t in_range = 0;
+	for (size_t i = 0; i < seen_count; i++) {
+		if (seen[i] >= lo && seen[i] <= hi) in_range++;
+	}
+	check(btree_scan(disk, root, lo, hi, NULL, NULL, NULL) == (int64_t)in_range, "range scan merges buffered updates");
+	check(node->num_msgs == 60, "whole-tree reads leave the buffer alone");
+
+	btree_flush_buffer(disk, root);
+	check(node->num_msgs == 0, "flush empties the buffer");
+	traverse_keys(disk, root);
+	check(same_keys(keys, 20, 140), "flushed tree holds the same keys");
+	hit = btree_lookup(disk, root, keys[120], BTREE_ACCESS_TREE);
+	check(hit != (uint64_t)-1 && hit != BTREE_BUFFERED, "flushed insert is found in a leaf");
+	check(btree_lookup(disk, root, keys[10], BTREE_ACCESS_TREE) == (uint64_t)-1, "flushed delete stays deleted");
+
+	free(keys);
+	disk_close(disk);
+}
+
+typedef struct ScanCheck {
+	uint64_t last;
+	int64_t count;
+	bool ordered;
+} ScanCheck;
+
+static void scan_check(uint64_t key, uint64_t value, void* arg)
+{
+	ScanCheck *sc = (ScanCheck*)arg;
+
+	if (sc->count != 0 && key <= sc->last) sc->ordered = false;
+	sc->last = key;
+	sc->count++;
+}
+
+// Allocated blocks outside the view's region
+static uint64_t used_outside(DiskInterface* view)
+{
+	void *bm = get_block_bitmap(view);
+	uint64_t used = 0;
+
+	for (uint64_t b = 0; b < CHECK_IMAGE_BLOCKS; b++) {
+		if ((b < view->alloc_start || b >= view->alloc_end) && bitmap_get(bm, b)) used++;
+	}
+
+	return used;
+}
+
+static void check_shards(void)
+{
+	DiskInterface *disk = check_image(CHECK_IMAGE);
+	uint64_t *keys = check_keys(400);		// Keys below 2800
+	uint64_t width = 4000 / 4 + 1;
+
+	check(shard_format(disk, 4, SHARD_ROUTE_RANGE, 4000) == 0, "range-sharded image formats");
+	ShardSet *set = shard_open(disk);
+	check(disk->alloc_end == BITMAP_BYTES * 8 && set->views[3].alloc_end == disk->alloc_end,
+		"block bitmap covers the whole image when sharded");
+	check(bitmap_get(get_block_bitmap(disk), SUPERBLOCK_BLOCK) && set->views[0].alloc_start == 0,
+		"superblock block is reserved inside the first shard's region");
+
+	bool routed = true, placed = true;
+	for (int i = 0; i < 400; i++) {
+		shard_insert(set, keys[i]);
+		if (shard_of(set, keys[i]) != (int)(keys[i] / width)) routed = false;
+	}
+	for (int i = 0; i < 400; i++) {
+		ShardEntry *entry = &set->super->shards[shard_of(set, keys[i])];
+		uint64_t leaf = shard_lookup(set, keys[i], BTREE_ACCESS_TREE);
+		if (leaf < entry->alloc_start || leaf >= entry->alloc_end) placed = false;
+	}
+	check(routed, "range routing sends each key to the shard owning its range");
+	check(placed, "every key is stored inside its shard's region");
+	check(shard_lookup(set, 1, BTREE_ACCESS_OPTIMISTIC) == (uint64_t)-1, "missing key is not found in any shard");
+
+	bool deleted = true;
+	for (int i = 0; i < 50; i++) {
+		if (shard_delete(set, keys[i]) == -1) deleted = false;
+	}
+	check(deleted && shard_delete(set, keys[0]) == -1, "shard delete reports missing keys");
+
+	uint64_t lo = 500, hi = 2300, expect = 0;
+	for (int i = 50; i < 400; i++) {
+		if (keys[i] >= lo && keys[i] <= hi) expect++;
+	}
+	ScanCheck sc = { 0, 0, true };
+	int64_t total = shard_range_scan(set, lo, hi, scan_check, &sc);
+	check(total == (int64_t)expect && sc.count == total, "range scan across shards returns every key in range");
+	check(sc.ordered, "range scan across shards is in ascending order");
+
+	// Rebuilds into a shard view must stay inside that shard's region
+	DiskInterface *src = check_image(CHECK_REBUILD_IMAGE);
+	uint64_t src_root = check_tree(src), new_root;
+	for (int i = 0; i < 9000; i++) btree_insert(src, src_root, (uint64_t)i * 3 + 1);
+	check(btree_parallel_rebuild(src, src_root, &set->views[1], 2, 1.0, &new_root) == -1, "rebuild larger than a shard region is refused");
+	disk_close(src);
+	src = check_image(CHECK_REBUILD_IMAGE);
+	src_root = check_tree(src);
+	for (int i = 0; i < 1000; i++) btree_insert(src, src_root, (uint64_t)i * 3 + 1);
+	uint64_t outside = used_outside(&set->views[1]);
+	check(btree_parallel_rebuild(src, src_root, &set->views[1], 2, 1.0, &new_root) == 0, "rebuild that fits a shard region succeeds");
+	check(used_outside(&set->views[1]) == outside && new_root >= set->views[1].alloc_start &&
+	      traverse_keys(&set->views[1], new_root) == 1000, "rebuilt tree lives in the shard's region");
+	disk_close(src);
+	shard_close(set);
+	disk_close(disk);
+
+	disk = check_image(CHECK_IMAGE);
+	shard_format(disk, 3, SHARD_ROUTE_HASH, 0);
+	set = shard_open(disk);
+	for (int i = 0; i < 400; i++) shard_insert(set, keys[i]);
+	sc = (ScanCheck){ 0, 0, true };
+	total = shard_range_scan(set, 0, UINT64_MAX, scan_check, &sc);
+	check(total == 400 && sc.ordered, "hash-routed range scan merges every shard in order");
+	shard_close(set);
+
+	unlink(CHECK_REBUILD_IMAGE);
+	free(keys);
+	disk_close(disk);
+}
+
+// btree_scan over [lo, hi] must report exactly the traversal's keys in that range
+static bool scan_matches(DiskInterface* disk, uint64_t root, uint64_t lo, uint64_t hi, const BTreeScanOptions* opts, BTreeScanStats* stats)
+{
+	size_t count = traverse_keys(disk, root);
+	uint64_t *expect = (uint64_t*)malloc((count ? count : 1) * sizeof(uint64_t));
+	size_t in_range = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		if (seen[i] >= lo && seen[i] <= hi) expect[in_range++] = seen[i];
+	}
+
+	seen_count = 0;
+	int64_t rv = btree_scan(disk, root, lo, hi, seen_add, opts, stats);
+	qsort(seen, seen_count, sizeof(uint64_t), key_compare);
+	bool same = (rv == (int64_t)in_range && seen_count == in_range);
+	for (size_t i = 0; same && i < in_range; i++) {
+		if (seen[i] != expect[i]) same = false;
+	}
+
+	free(expect);
+	return same;
+}
+
+// Leaf blocks in the scan's DFS order, and how far a scan has got through them
+static uint64_t *leaf_order;
+static size_t leaf_count, leaf_scanned;
+static DiskInterface *leaf_disk;
+static bool leaf_ready;
+
+static void collect_leaves(DiskInterface* disk, uint64_t block)
+{
+	BTreeNode *node = (BTreeNode*)get_block(disk, block);
+	if (node->is_leaf) {
+		leaf_order[leaf_count++] = block;
+		return;
+	}
+	for (int i = 0; i <= node->num_keys; i++) {
+		if (node->children[i] != 0) collect_leaves(disk, node->children[i]);
+	}
+}
+
+static bool block_resident(DiskInterface* disk, uint64_t block)
+{
+	unsigned char vec = 0;
+	mincore(get_block(disk, block), BLOCK_SIZE, &vec);
+	return vec & 1;
+}
+
+// Write the image back, evict it, and stop faults reading neighbours in
+static void drop_cache(DiskInterface* disk)
+{
+	size_t length = disk->total_blocks * BLOCK_SIZE;
+
+	msync(disk->disk_base, length, MS_SYNC);
+	madvise(disk->disk_base, length, MADV_DONTNEED);
+	posix_fadvise(disk->disk_file, 0, length, POSIX_FADV_DONTNEED);
+	madvise(disk->disk_base, length, MADV_RANDOM);
+}
+
+// Called as each leaf is reported: the scan has not touched the next leaf
+// yet, so it only comes into the cache if the lookahead hinted it
+static void leaf_resident(uint64_t key, uint64_t value)
+{
+	if (++leaf_scanned >= leaf_count || !leaf_ready) return;
+	uint64_t next = leaf_order[leaf_scanned];
+	for (int tries = 0; tries < 200 && !block_resident(leaf_disk, next); tries++) usleep(500);
+	if (!block_resident(leaf_disk, next)) leaf_ready = false;
+}
+
+static void check_scan(void)
+{
+	DiskInterface *disk = check_image(CHECK_IMAGE);
+	uint64_t root = check_tree(disk);
+	uint64_t *keys = check_keys(1500);
+	BTreeScanOptions fixed = { 16, 0, false }, adaptive = { 1, 0, true };
+	BTreeScanStats stats;
+
+	for (int i = 0; i < 1500; i++) btree_insert(disk, root, keys[i]);
+	for (int i = 0; i < 200; i++) btree_delete(disk, root, keys[i]);
+
+	check(scan_matches(disk, root, 0, UINT64_MAX, NULL, NULL), "unprefetched scan matches the traversal");
+	check(scan_matches(disk, root, 1000, 6000, &fixed, &stats), "prefetching scan matches the traversal over [lo, hi]");
+	check(stats.max_ahead == 16, "lookahead keeps a full window of blocks in flight");
+	check(scan_matches(disk, root, 2000, 2600, &adaptive, NULL), "adaptive scan matches the traversal over [lo, hi]");
+
+	DiskInterface *dst = check_image(CHECK_REBUILD_IMAGE);
+	uint64_t new_root;
+	btree_parallel_rebuild(disk, root, dst, 1, 1.0, &new_root);
+	bool grows = true;
+	uint64_t last = 0;
+	for (int window = 4; window <= SCAN_MAX_WINDOW; window *= 4) {
+		BTreeScanOptions opts = { window, 0, false };
+		if (!scan_matches(dst, new_root, 0, UINT64_MAX, &opts, &stats) || stats.max_ahead <= last) grows = false;
+		last = stats.max_ahead;
+	}
+	check(grows, "blocks in flight grow with the window beyond the fanout");
+	check(scan_matches(dst, new_root, 500, 4000, &adaptive, &stats) && stats.final_window == SCAN_MAX_WINDOW,
+	      "adaptive window opens fully on a rebuilt tree");
+
+	// After a cache drop, each leaf must already be on its way in when the scan reaches it
+	leaf_order = (uint64_t*)malloc(CHECK_IMAGE_BLOCKS * sizeof(uint64_t));
+	leaf_count = 0;
+	leaf_disk = dst;
+	collect_leaves(dst, new_root);
+	drop_cache(dst);
+	bool evicted = !block_resident(dst, leaf_order[leaf_count / 2]);
+	BTreeScanOptions hinted = { 16, 0, false };
+	leaf_scanned = 0;
+	leaf_ready = true;
+	btree_scan(dst, new_root, 0, UINT64_MAX, leaf_resident, &hinted, NULL);
+	check(evicted && leaf_ready, "leaves in the window are hinted before the scan touches them");
+
+	drop_cache(dst);
+	BTreeScanOptions unhinted = { 0, 0, false };
+	leaf_scanned = 0;
+	leaf_ready = true;
+	btree_scan(dst, new_root, 0, UINT64_MAX, leaf_resident, &unhinted, NULL);
+	check(!leaf_ready, "without a window the next leaf is not read in ahead of the scan");
+	free(leaf_order);
+
+	disk_close(dst);
+	unlink(CHECK_REBUILD_IMAGE);
+	free(keys);
+	disk_close(disk);
+}
+
+int main(int argc, char** argv)
+{
+	// The tree code logs to stdout; keep it out of the report
+	fflush(stdout);
+	report = fdopen(dup(1), "w");
+	setvbuf(report, NULL, _IOLBF, 0);
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, 1);
+	close(devnull);
+
+	// A node left locked makes the next writer spin forever; fail instead of hanging
+	alarm(120);
+	seen = (uint64_t*)malloc(CHECK_IMAGE_BLOCKS * sizeof(uint64_t));
+	srand(42);
+	check_hash_index();
+	check_parallel();
+	check_optimistic();
+	check_buffered();
+	check_shards();
+	check_scan();
+
+	fprintf(report, "1..%d\n", checks_run);
+	fclose(report);
+	free(seen);
+	unlink(CHECK_IMAGE);
+	return checks_failed != 0;
+}
@@ -5,6 +5,20 @@
 #define BLOCK_SIZE 4096          // Size of each disk block in bytes
 #define MAX_KEYS 4             // Maximum keys per node (adjust based on key size)
 #define MIN_KEYS (MAX_KEYS / 2)  // Minimum keys per node
+#define BITMAP_BYTES BLOCK_SIZE  // Block bitmap fills block 0
+#define SUPERBLOCK_BLOCK 1       // Shard root table; block 1 is otherwise unused by the layout
+#define MAX_SHARDS 16            // Maximum independent trees in a sharded image
+#define MSG_BUFFER_SIZE 128      // Buffered updates per node in write-optimized mode
+#define SCAN_MAX_WINDOW 64       // Default upper bound for the adaptive prefetch window
+#define HASH_MAX_DEPTH 8         // Maximum global depth of the hash index directory
+
+// Debug tracing on the insert, lookup and allocation paths. printf takes
+// stdout's lock, so builds that measure concurrency define BTREE_QUIET.
+#ifdef BTREE_QUIET
+#define BTREE_LOG(...) ((void)0)
+#else
+#define BTREE_LOG(...) printf(__VA_ARGS__)
+#endif
 
 #endif
 
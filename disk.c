@@ -8,6 +8,7 @@
 
 #include "disk.h"
 #include "config.h"
+#include "epoch.h"
 
 // Disk operations
 DiskInterface* disk_open(const char* filename)
@@ -27,12 +28,19 @@ DiskInterface* disk_open(const char* filename)
 	assert(disk->disk_base != MAP_FAILED);
 	
 	disk->total_blocks = fs_info.st_size / BLOCK_SIZE;
+	disk->alloc_start = 0;
+	disk->alloc_end = disk->total_blocks;
+	if (disk->alloc_end > BITMAP_BYTES * 8) {
+		disk->alloc_end = BITMAP_BYTES * 8;	// Blocks past the bitmap cannot be tracked
+	}
+	disk->retired = NULL;
 	
 	return disk;
 }
 
 void disk_close(DiskInterface* disk)
 {
+	epoch_release(disk);
 	munmap(disk->disk_base, disk->total_blocks * BLOCK_SIZE);
 	close(disk->disk_file);
 	free(disk);
@@ -47,7 +55,7 @@ get_block(DiskInterface* disk, int pnum)
 void*
 get_superblock(DiskInterface* disk)
 {
-	return get_block(disk, 0);
+	return get_block(disk, SUPERBLOCK_BLOCK);
 }
 
 
@@ -81,10 +89,10 @@ alloc_page(DiskInterface* disk)
 {
 	void* pbm = get_block_bitmap(disk);
 
-	for (int ii = 0; ii < disk->total_blocks; ++ii) {
+	for (int ii = disk->alloc_start; ii < disk->alloc_end; ++ii) {
 		if (!bitmap_get(pbm, ii)) {
 			bitmap_put(pbm, ii, 1);
-			printf("+ alloc_page() -> %d\n", ii);
+			BTREE_LOG("+ alloc_page() -> %d\n", ii);
 			return ii;
 		}
 	}
@@ -95,7 +103,7 @@ alloc_page(DiskInterface* disk)
 void
 free_page(DiskInterface* disk, int pnum)
 {
-	printf("+ free_page(%d)\n", pnum);
+	BTREE_LOG("+ free_page(%d)\n", pnum);
 	void* pbm = get_block_bitmap(disk);
 	bitmap_put(pbm, pnum, 0);
 }
@@ -124,4 +132,15 @@ int disk_write_block(DiskInterface* disk, uint64_t block_num, const void* buffer
 	return rv;
 }
 
+// Hint the kernel to start reading blocks we are about to touch
+int disk_prefetch(DiskInterface* disk, uint64_t block_num, uint64_t count)
+{
+	if (block_num >= disk->total_blocks) return -1;
+	if (block_num + count > disk->total_blocks) {
+		count = disk->total_blocks - block_num;
+	}
+	
+	return madvise(get_block(disk, block_num), count * BLOCK_SIZE, MADV_WILLNEED);
+}
+
 int disk_format(DiskInterface* disk, const char* volume_name);
@@ -14,6 +14,9 @@ typedef struct DiskInterface {
     void* disk_base;
     uint64_t total_blocks;           // Total blocks available
     bool is_mounted;                 // Whether filesystem is mounted
+    uint64_t alloc_start;            // First block alloc_page may hand out
+    uint64_t alloc_end;              // One past the last block alloc_page may hand out
+    struct RetiredList* retired;     // Pages freed under epoch reclamation, not yet reusable
 } DiskInterface;
 
 // Disk operations
@@ -28,6 +31,7 @@ int alloc_page(DiskInterface* disk);
 void free_page(DiskInterface* disk, int pnum);
 int disk_read_block(DiskInterface* disk, uint64_t block_num, void* buffer);
 int disk_write_block(DiskInterface* disk, uint64_t block_num, const void* buffer);
+int disk_prefetch(DiskInterface* disk, uint64_t block_num, uint64_t count);
 int disk_format(DiskInterface* disk, const char* volume_name);
 
 #endif
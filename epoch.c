@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "epoch.h"
+
+typedef struct EpochSlot {
+	uint64_t epoch;			// Epoch observed on entry, 0 while outside
+	char pad[64 - sizeof(uint64_t)];	// One cache line per thread
+} EpochSlot;
+
+typedef struct RetiredPage {
+	uint64_t block;
+	uint64_t epoch;			// Global epoch at the time of retirement
+} RetiredPage;
+
+// One list per DiskInterface, so writers on different shards never share it
+typedef struct RetiredList {
+	pthread_mutex_t lock;
+	RetiredPage *pages;
+	size_t count;			// Read without the lock to skip empty lists
+	size_t capacity;
+} RetiredList;
+
+static uint64_t global_epoch = 1;
+static EpochSlot slots[EPOCH_MAX_THREADS];
+static int next_hint = 0;
+static __thread int my_slot = -1;		// Slot held inside a critical section, else where to look first
+
+// A slot belongs to a thread only while it is inside a critical section
+void epoch_enter(void)
+{
+	if (my_slot == -1) {
+		my_slot = __atomic_fetch_add(&next_hint, 1, __ATOMIC_RELAXED) % EPOCH_MAX_THREADS;
+	}
+	
+	while (true) {
+		uint64_t e = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+		for (int n = 0; n < EPOCH_MAX_THREADS; n++) {
+			int i = (my_slot + n) % EPOCH_MAX_THREADS;
+			uint64_t free_slot = 0;
+			if (__atomic_compare_exchange_n(&slots[i].epoch, &free_slot, e, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				my_slot = i;
+				return;
+			}
+		}
+		// More readers than slots: wait for one of them to leave
+		sched_yield();
+	}
+}
+
+void epoch_exit(void)
+{
+	__atomic_store_n(&slots[my_slot].epoch, 0, __ATOMIC_SEQ_CST);
+}
+
+void epoch_retire(DiskInterface* disk, uint64_t block)
+{
+	RetiredList *list = disk->retired;
+	
+	// Writers on a disk are serialized, so only they ever create its list
+	if (list == NULL) {
+		list = (RetiredList*)calloc(1, sizeof(RetiredList));
+		pthread_mutex_init(&list->lock, NULL);
+		__atomic_store_n(&disk->retired, list, __ATOMIC_RELEASE);
+	}
+	
+	pthread_mutex_lock(&list->lock);
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->pages = (RetiredPage*)realloc(list->pages, list->capacity * sizeof(RetiredPage));
+	}
+	list->pages[list->count].block = block;
+	list->pages[list->count].epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&list->lock);
+}
+
+// A reader that entered at epoch e can only hold pages retired at e or later
+static void epoch_reclaim(DiskInterface* disk, RetiredList* list)
+{
+	uint64_t oldest = UINT64_MAX;
+	
+	for (int i = 0; i < EPOCH_MAX_THREADS; i++) {
+		uint64_t e = __atomic_load_n(&slots[i].epoch, __ATOMIC_SEQ_CST);
+		if (e != 0 && e < oldest) oldest = e;
+	}
+	
+	size_t kept = 0;
+	uint64_t newest = 0;
+	for (size_t i = 0; i < list->count; i++) {
+		if (list->pages[i].epoch < oldest) {
+			free_page(disk, list->pages[i].block);
+		} else {
+			if (list->pages[i].epoch > newest) newest = list->pages[i].epoch;
+			list->pages[kept++] = list->pages[i];
+		}
+	}
+	__atomic_store_n(&list->count, kept, __ATOMIC_RELEASE);
+	
+	// Only pages held back by a reader need the epoch to move on; readers
+	// entering after that can no longer hold them
+	if (kept != 0) {
+		uint64_t e = newest;
+		__atomic_compare_exchange_n(&global_epoch, &e, newest + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	}
+}
+
+static RetiredList* epoch_pending(DiskInterface* disk)
+{
+	RetiredList *list = __atomic_load_n(&disk->retired, __ATOMIC_ACQUIRE);
+	
+	if (list == NULL || __atomic_load_n(&list->count, __ATOMIC_ACQUIRE) == 0) return NULL;
+	return list;
+}
+
+void epoch_collect(DiskInterface* disk)
+{
+	RetiredList *list = epoch_pending(disk);
+	if (list == NULL) return;
+	
+	pthread_mutex_lock(&list->lock);
+	epoch_reclaim(disk, list);
+	pthread_mutex_unlock(&list->lock);
+}
+
+void epoch_try_collect(DiskInterface* disk)
+{
+	RetiredList *list = epoch_pending(disk);
+	if (list == NULL) return;
+	
+	if (pthread_mutex_trylock(&list->lock) == 0) {
+		epoch_reclaim(disk, list);
+		pthread_mutex_unlock(&list->lock);
+	}
+}
+
+void epoch_release(DiskInterface* disk)
+{
+	RetiredList *list = disk->retired;
+	if (list == NULL) return;
+	
+	epoch_collect(disk);
+	if (list->count != 0) {
+		printf("ERROR: Closing a disk with %lu pages still held by readers\n", list->count);
+	}
+	pthread_mutex_destroy(&list->lock);
+	free(list->pages);
+	free(list);
+	disk->retired = NULL;
+}
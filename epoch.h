@@ -0,0 +1,25 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdint.h>
+#include "disk.h"
+
+// ==================== EPOCH-BASED RECLAMATION ====================
+
+// Optimistic readers may still be looking at a page after a writer unlinks
+// it, so freed pages are parked here until every reader that could have
+// seen them has left its critical section.
+#define EPOCH_MAX_THREADS 64		// Readers inside a critical section at once; more wait
+
+// Reader critical sections
+void epoch_enter(void);
+void epoch_exit(void);
+
+// Writer side: defer free_page until it is safe, then reclaim what we can at
+// a quiescent point. Retired pages are kept per DiskInterface (per shard view).
+void epoch_retire(DiskInterface* disk, uint64_t block);
+void epoch_collect(DiskInterface* disk);
+void epoch_try_collect(DiskInterface* disk);	// Never blocks; for readers
+void epoch_release(DiskInterface* disk);	// Reclaim and free the list before the disk goes away
+
+#endif
@@ -14,6 +14,13 @@ unsigned int hash(const unsigned char *str)
     return hash;
 }
 
+unsigned int hash_u64(uint64_t key)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lu", key);
+    return hash((const unsigned char*)buf);
+}
+
 /*int main() {
 	printf("%ld\n", hash("hello") % 512);
 }*/
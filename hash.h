@@ -1,6 +1,9 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stdint.h>
+
 unsigned int hash(const unsigned char *str);
+unsigned int hash_u64(uint64_t key);
 
 #endif
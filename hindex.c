@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <string.h>
+#include "hindex.h"
+#include "hash.h"
+
+static HashBucket* hash_index_bucket_create(DiskInterface* disk, uint32_t local_depth, uint64_t* block)
+{
+	int page = alloc_page(disk);
+	if (page == -1) return NULL;
+
+	HashBucket *bucket = (HashBucket*)get_block(disk, page);
+	memset(bucket, 0, BLOCK_SIZE);
+	bucket->local_depth = local_depth;
+	*block = page;
+
+	return bucket;
+}
+
+uint64_t hash_index_create(DiskInterface* disk)
+{
+	int page = alloc_page(disk);
+	if (page == -1) return 0;
+
+	HashDirectory *dir = (HashDirectory*)get_block(disk, page);
+	memset(dir, 0, BLOCK_SIZE);
+
+	uint64_t bucket_block;
+	if (hash_index_bucket_create(disk, 0, &bucket_block) == NULL) {
+		free_page(disk, page);
+		return 0;
+	}
+	dir->global_depth = 0;
+	dir->num_buckets = 1;
+	dir->buckets[0] = bucket_block;
+
+	return page;
+}
+
+void hash_index_destroy(DiskInterface* disk, uint64_t dir_block)
+{
+	HashDirectory *dir = (HashDirectory*)get_block(disk, dir_block);
+	uint32_t entries = 1u << dir->global_depth;
+
+	// Several directory slots share a bucket; free each one on its first slot
+	for (uint32_t i = 0; i < entries; i++) {
+		HashBucket *bucket = (HashBucket*)get_block(disk, dir->buckets[i]);
+		uint32_t stride = 1u << bucket->local_depth;
+		if (i < stride) free_page(disk, dir->buckets[i]);
+	}
+	free_page(disk, dir_block);
+}
+
+static int hash_index_split(DiskInterface* disk, HashDirectory* dir, uint32_t slot)
+{
+	uint64_t old_block = dir->buckets[slot];
+	HashBucket *old = (HashBucket*)get_block(disk, old_block);
+
+	if (old->local_depth == dir->global_depth) {
+		if (dir->global_depth == HASH_MAX_DEPTH) {
+			printf("ERROR: Hash index directory is at maximum depth\n");
+			return -1;
+		}
+		uint32_t entries = 1u << dir->global_depth;
+		memcpy(&dir->buckets[entries], &dir->buckets[0], entries * sizeof(uint64_t));
+		dir->global_depth++;
+	}
+
+	uint32_t bit = 1u << old->local_depth;
+	uint64_t new_block;
+	HashBucket *new = hash_index_bucket_create(disk, old->local_depth + 1, &new_block);
+	if (new == NULL) return -1;
+	old->local_depth++;
+	dir->num_buckets++;
+
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < old->num_entries; i++) {
+		if (hash_u64(old->entries[i].key) & bit) {
+			new->entries[new->num_entries++] = old->entries[i];
+		} else {
+			old->entries[kept++] = old->entries[i];
+		}
+	}
+	old->num_entries = kept;
+
+	for (uint32_t i = 0; i < (1u << dir->global_depth); i++) {
+		if (dir->buckets[i] == old_block && (i & bit)) {
+			dir->buckets[i] = new_block;
+		}
+	}
+
+	return 0;
+}
+
+int hash_index_insert(DiskInterface* disk, uint64_t dir_block, uint64_t key, uint64_t value)
+{
+	HashDirectory *dir = (HashDirectory*)get_block(disk, dir_block);
+	unsigned int h = hash_u64(key);
+
+	while (true) {
+		uint32_t slot = h & ((1u << dir->global_depth) - 1);
+		HashBucket *bucket = (HashBucket*)get_block(disk, dir->buckets[slot]);
+
+		for (uint32_t i = 0; i < bucket->num_entries; i++) {
+			if (bucket->entries[i].key == key) {
+				bucket->entries[i].value = value;
+				return 0;
+			}
+		}
+
+		if (bucket->num_entries < HASH_BUCKET_ENTRIES) {
+			bucket->entries[bucket->num_entries].key = key;
+			bucket->entries[bucket->num_entries].value = value;
+			bucket->num_entries++;
+			return 0;
+		}
+
+		if (hash_index_split(disk, dir, slot) != 0) return -1;
+	}
+}
+
+int hash_index_delete(DiskInterface* disk, uint64_t dir_block, uint64_t key)
+{
+	HashDirectory *dir = (HashDirectory*)get_block(disk, dir_block);
+	uint32_t slot = hash_u64(key) & ((1u << dir->global_depth) - 1);
+	HashBucket *bucket = (HashBucket*)get_block(disk, dir->buckets[slot]);
+
+	// Buckets are never merged back; an emptied bucket is simply reused
+	for (uint32_t i = 0; i < bucket->num_entries; i++) {
+		if (bucket->entries[i].key == key) {
+			bucket->entries[i] = bucket->entries[bucket->num_entries - 1];
+			bucket->num_entries--;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+uint64_t hash_index_lookup(DiskInterface* disk, uint64_t dir_block, uint64_t key)
+{
+	HashDirectory *dir = (HashDirectory*)get_block(disk, dir_block);
+	uint32_t slot = hash_u64(key) & ((1u << dir->global_depth) - 1);
+	HashBucket *bucket = (HashBucket*)get_block(disk, dir->buckets[slot]);
+
+	for (uint32_t i = 0; i < bucket->num_entries; i++) {
+		if (bucket->entries[i].key == key) {
+			return bucket->entries[i].value;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,41 @@
+#ifndef HINDEX_H
+#define HINDEX_H
+
+#include <stdint.h>
+#include "config.h"
+#include "disk.h"
+
+// ==================== HASH INDEX ====================
+
+// Extendible hash index living in the same image as the B-tree. A lookup
+// reads the directory block and then exactly one bucket block.
+#define HASH_DIR_ENTRIES (1 << HASH_MAX_DEPTH)
+#define HASH_BUCKET_ENTRIES ((BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(HashEntry))
+
+typedef struct HashEntry {
+    uint64_t key;			// Key (inode number)
+    uint64_t value;			// Block number of the B-tree leaf holding the key
+} HashEntry;
+
+typedef struct HashDirectory {
+    uint32_t global_depth;		// Number of hash bits used to index buckets
+    uint32_t num_buckets;		// Distinct bucket blocks referenced below
+    uint64_t buckets[HASH_DIR_ENTRIES];	// Bucket block numbers
+} HashDirectory;
+
+_Static_assert(sizeof(HashDirectory) <= BLOCK_SIZE, "HashDirectory must fit in one block; lower HASH_MAX_DEPTH");
+
+typedef struct HashBucket {
+    uint32_t local_depth;		// Number of hash bits shared by every entry
+    uint32_t num_entries;		// Current number of entries
+    HashEntry entries[];		// Fills the rest of the block
+} HashBucket;
+
+// Hash index operations
+uint64_t hash_index_create(DiskInterface* disk);
+void hash_index_destroy(DiskInterface* disk, uint64_t dir_block);
+int hash_index_insert(DiskInterface* disk, uint64_t dir_block, uint64_t key, uint64_t value);
+int hash_index_delete(DiskInterface* disk, uint64_t dir_block, uint64_t key);
+uint64_t hash_index_lookup(DiskInterface* disk, uint64_t dir_block, uint64_t key);
+
+#endif
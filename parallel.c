@@ -0,0 +1,523 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "parallel.h"
+#include "bitmap.h"
+#include "hindex.h"
+
+// ==================== WORK-STEALING TRAVERSAL ====================
+
+typedef struct WorkDeque {
+	pthread_mutex_t lock;
+	uint64_t *blocks;
+	int head;			// Thieves steal here (oldest, largest subtrees)
+	int tail;			// Owner pushes and pops here
+	int capacity;
+} WorkDeque;
+
+typedef struct WalkState {
+	DiskInterface *disk;
+	BTreeVisitor visit;
+	void *arg;
+	int num_threads;
+	WorkDeque *deques;
+	uint64_t pending;		// Tasks queued or running, updated atomically
+} WalkState;
+
+typedef struct WalkWorker {
+	WalkState *state;
+	int id;
+} WalkWorker;
+
+static void deque_push(WorkDeque* dq, uint64_t block)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->capacity) {
+		if (dq->head > 0) {
+			memmove(dq->blocks, dq->blocks + dq->head, (dq->tail - dq->head) * sizeof(uint64_t));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		} else {
+			dq->capacity = dq->capacity ? dq->capacity * 2 : 64;
+			dq->blocks = (uint64_t*)realloc(dq->blocks, dq->capacity * sizeof(uint64_t));
+		}
+	}
+	dq->blocks[dq->tail++] = block;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+static bool deque_pop(WorkDeque* dq, uint64_t* block)
+{
+	bool rv = false;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		*block = dq->blocks[--dq->tail];
+		rv = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return rv;
+}
+
+static bool deque_steal(WorkDeque* dq, uint64_t* block)
+{
+	bool rv = false;
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		*block = dq->blocks[dq->head++];
+		rv = true;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return rv;
+}
+
+static void* walk_worker(void* p)
+{
+	WalkWorker *w = (WalkWorker*)p;
+	WalkState *st = w->state;
+	uint64_t block;
+
+	while (__atomic_load_n(&st->pending, __ATOMIC_ACQUIRE) != 0) {
+		bool found = deque_pop(&st->deques[w->id], &block);
+		for (int i = 1; !found && i < st->num_threads; i++) {
+			found = deque_steal(&st->deques[(w->id + i) % st->num_threads], &block);
+		}
+		if (!found) {
+			sched_yield();
+			continue;
+		}
+
+		BTreeNode *node = (BTreeNode*)get_block(st->disk, block);
+		st->visit(st->disk, node, st->arg, w->id);
+
+		// Children are queued before this task retires so pending never drops to zero early
+		if (!node->is_leaf) {
+			for (int i = node->num_keys; i >= 0; i--) {
+				if (node->children[i] != 0) {
+					__atomic_add_fetch(&st->pending, 1, __ATOMIC_RELEASE);
+					deque_push(&st->deques[w->id], node->children[i]);
+				}
+			}
+		}
+		__atomic_sub_fetch(&st->pending, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+int btree_parallel_walk(DiskInterface* disk, uint64_t root_block, int num_threads, BTreeVisitor visit, void* arg)
+{
+	if (num_threads < 1) num_threads = 1;
+
+	WalkState st = { disk, visit, arg, num_threads, NULL, 1 };
+	st.deques = (WorkDeque*)calloc(num_threads, sizeof(WorkDeque));
+	pthread_t *threads = (pthread_t*)calloc(num_threads, sizeof(pthread_t));
+	WalkWorker *workers = (WalkWorker*)calloc(num_threads, sizeof(WalkWorker));
+	if (st.deques == NULL || threads == NULL || workers == NULL) {
+		free(st.deques);
+		free(threads);
+		free(workers);
+		return -1;
+	}
+
+	for (int i = 0; i < num_threads; i++) {
+		pthread_mutex_init(&st.deques[i].lock, NULL);
+		workers[i].state = &st;
+		workers[i].id = i;
+	}
+	deque_push(&st.deques[0], root_block);
+
+	for (int i = 1; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, walk_worker, &workers[i]);
+	}
+	walk_worker(&workers[0]);
+	for (int i = 1; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (int i = 0; i < num_threads; i++) {
+		pthread_mutex_destroy(&st.deques[i].lock);
+		free(st.deques[i].blocks);
+	}
+	free(st.deques);
+	free(threads);
+	free(workers);
+
+	return 0;
+}
+
+// ==================== RANGE PARTITIONING ====================
+
+typedef void (*RangeFn)(size_t begin, size_t end, void* arg);
+
+typedef struct RangeTask {
+	RangeFn fn;
+	void *arg;
+	size_t begin;
+	size_t end;
+} RangeTask;
+
+static void* range_worker(void* p)
+{
+	RangeTask *t = (RangeTask*)p;
+	t->fn(t->begin, t->end, t->arg);
+	return NULL;
+}
+
+// Split [0, count) into num_threads contiguous chunks and run fn on each
+static void parallel_for(int num_threads, size_t count, RangeFn fn, void* arg)
+{
+	if (num_threads < 1) num_threads = 1;
+	if ((size_t)num_threads > count) num_threads = count ? count : 1;
+
+	pthread_t threads[num_threads];
+	RangeTask tasks[num_threads];
+	size_t chunk = (count + num_threads - 1) / num_threads;
+
+	for (int i = 0; i < num_threads; i++) {
+		tasks[i].fn = fn;
+		tasks[i].arg = arg;
+		tasks[i].begin = i * chunk < count ? i * chunk : count;
+		tasks[i].end = (i + 1) * chunk < count ? (i + 1) * chunk : count;
+		if (i > 0) pthread_create(&threads[i], NULL, range_worker, &tasks[i]);
+	}
+	range_worker(&tasks[0]);
+	for (int i = 1; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+// Per-worker results plus the root's pending updates, which whole-tree jobs merge in
+typedef struct BufferedWalk {
+	void *partial;
+	BTreeMessage net[MSG_BUFFER_SIZE];
+	int num_net;
+} BufferedWalk;
+
+static void buffered_walk_init(DiskInterface* disk, uint64_t root_block, BufferedWalk* bw, void* partial)
+{
+	bw->partial = partial;
+	bw->num_net = btree_buffer_net((BTreeNode*)get_block(disk, root_block), bw->net);
+}
+
+// ==================== COUNT / AGGREGATE ====================
+
+static void aggregate_key(BTreeAggregate* agg, uint64_t key)
+{
+	agg->leaves++;
+	agg->key_sum += key;
+	if (key < agg->min_key) agg->min_key = key;
+	if (key > agg->max_key) agg->max_key = key;
+}
+
+static void aggregate_visit(DiskInterface* disk, BTreeNode* node, void* arg, int worker)
+{
+	BufferedWalk *bw = (BufferedWalk*)arg;
+	BTreeAggregate *agg = &((BTreeAggregate*)bw->partial)[worker];
+
+	if (!node->is_leaf) {
+		agg->internal++;
+		return;
+	}
+
+	// Keys with a pending update are counted from the buffer instead
+	if (btree_buffer_find(bw->net, bw->num_net, node->key) != NULL) return;
+	aggregate_key(agg, node->key);
+}
+
+int btree_parallel_aggregate(DiskInterface* disk, uint64_t root_block, int num_threads, BTreeAggregate* out)
+{
+	if (num_threads < 1) num_threads = 1;
+
+	BTreeAggregate *partial = (BTreeAggregate*)calloc(num_threads, sizeof(BTreeAggregate));
+	if (partial == NULL) return -1;
+	for (int i = 0; i < num_threads; i++) {
+		partial[i].min_key = UINT64_MAX;
+	}
+
+	BufferedWalk bw;
+	buffered_walk_init(disk, root_block, &bw, partial);
+	if (btree_parallel_walk(disk, root_block, num_threads, aggregate_visit, &bw) != 0) {
+		free(partial);
+		return -1;
+	}
+	for (int i = 0; i < bw.num_net; i++) {
+		if (bw.net[i].op == BTREE_MSG_INSERT) aggregate_key(&partial[0], bw.net[i].key);
+	}
+
+	memset(out, 0, sizeof(BTreeAggregate));
+	out->min_key = UINT64_MAX;
+	for (int i = 0; i < num_threads; i++) {
+		out->leaves += partial[i].leaves;
+		out->internal += partial[i].internal;
+		out->key_sum += partial[i].key_sum;
+		if (partial[i].min_key < out->min_key) out->min_key = partial[i].min_key;
+		if (partial[i].max_key > out->max_key) out->max_key = partial[i].max_key;
+	}
+	if (out->leaves == 0) out->min_key = 0;
+
+	free(partial);
+	return 0;
+}
+
+uint64_t btree_parallel_count(DiskInterface* disk, uint64_t root_block, int num_threads)
+{
+	BTreeAggregate agg;
+
+	if (btree_parallel_aggregate(disk, root_block, num_threads, &agg) != 0) return -1;
+
+	return agg.leaves;
+}
+
+// ==================== EXPORT ====================
+
+typedef struct RecordVec {
+	BTreeRecord *recs;
+	size_t count;
+	size_t capacity;
+} RecordVec;
+
+static void record_push(RecordVec* vec, uint64_t key, uint64_t value)
+{
+	if (vec->count == vec->capacity) {
+		vec->capacity = vec->capacity ? vec->capacity * 2 : 256;
+		vec->recs = (BTreeRecord*)realloc(vec->recs, vec->capacity * sizeof(BTreeRecord));
+	}
+	vec->recs[vec->count].key = key;
+	vec->recs[vec->count].value = value;
+	vec->count++;
+}
+
+static void collect_visit(DiskInterface* disk, BTreeNode* node, void* arg, int worker)
+{
+	BufferedWalk *bw = (BufferedWalk*)arg;
+
+	if (!node->is_leaf) return;
+	if (btree_buffer_find(bw->net, bw->num_net, node->key) != NULL) return;
+
+	record_push(&((RecordVec*)bw->partial)[worker], node->key, node->value);
+}
+
+static int record_compare(const void* a, const void* b)
+{
+	const BTreeRecord *ra = (const BTreeRecord*)a;
+	const BTreeRecord *rb = (const BTreeRecord*)b;
+	return (ra->key > rb->key) - (ra->key < rb->key);
+}
+
+static void sort_vecs(size_t begin, size_t end, void* arg)
+{
+	RecordVec *vecs = (RecordVec*)arg;
+	for (size_t i = begin; i < end; i++) {
+		qsort(vecs[i].recs, vecs[i].count, sizeof(BTreeRecord), record_compare);
+	}
+}
+
+// Gather every leaf in parallel, sort each worker's run in parallel, then merge the runs
+static int btree_parallel_collect(DiskInterface* disk, uint64_t root_block, int num_threads, BTreeRecord** out, size_t* count)
+{
+	if (num_threads < 1) num_threads = 1;
+
+	RecordVec *vecs = (RecordVec*)calloc(num_threads, sizeof(RecordVec));
+	if (vecs == NULL) return -1;
+
+	BufferedWalk bw;
+	buffered_walk_init(disk, root_block, &bw, vecs);
+	if (btree_parallel_walk(disk, root_block, num_threads, collect_visit, &bw) != 0) {
+		free(vecs);
+		return -1;
+	}
+	for (int i = 0; i < bw.num_net; i++) {
+		if (bw.net[i].op == BTREE_MSG_INSERT) record_push(&vecs[0], bw.net[i].key, 0);
+	}
+	parallel_for(num_threads, num_threads, sort_vecs, vecs);
+
+	size_t total = 0;
+	for (int i = 0; i < num_threads; i++) {
+		total += vecs[i].count;
+	}
+
+	BTreeRecord *merged = (BTreeRecord*)malloc((total ? total : 1) * sizeof(BTreeRecord));
+	size_t *pos = (size_t*)calloc(num_threads, sizeof(size_t));
+	if (merged == NULL || pos == NULL) {
+		free(merged);
+		free(pos);
+		for (int i = 0; i < num_threads; i++) free(vecs[i].recs);
+		free(vecs);
+		return -1;
+	}
+
+	for (size_t n = 0; n < total; n++) {
+		int best = -1;
+		for (int i = 0; i < num_threads; i++) {
+			if (pos[i] < vecs[i].count &&
+			    (best == -1 || vecs[i].recs[pos[i]].key < vecs[best].recs[pos[best]].key)) {
+				best = i;
+			}
+		}
+		merged[n] = vecs[best].recs[pos[best]++];
+	}
+
+	for (int i = 0; i < num_threads; i++) free(vecs[i].recs);
+	free(vecs);
+	free(pos);
+
+	*out = merged;
+	*count = total;
+	return 0;
+}
+
+int64_t btree_parallel_export(DiskInterface* disk, uint64_t root_block, int num_threads, const char* filename)
+{
+	BTreeRecord *recs;
+	size_t count;
+
+	if (btree_parallel_collect(disk, root_block, num_threads, &recs, &count) != 0) return -1;
+
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open export file %s\n", filename);
+		free(recs);
+		return -1;
+	}
+
+	int64_t rv = count;
+	if (fwrite(recs, sizeof(BTreeRecord), count, fp) != count) rv = -1;
+	if (fclose(fp) != 0) rv = -1;
+
+	free(recs);
+	return rv;
+}
+
+// ==================== REBUILD ====================
+
+typedef struct RebuildLevel {
+	DiskInterface *disk;
+	BTreeRecord *recs;		// Sorted records (leaf level only)
+	uint64_t *children;		// Blocks of the level being grouped
+	uint64_t *child_max;		// Largest key below each child
+	size_t child_count;
+	uint64_t *parents;		// Blocks of the level being filled
+	uint64_t *parent_max;
+	int fanout;
+} RebuildLevel;
+
+static void fill_leaves(size_t begin, size_t end, void* arg)
+{
+	RebuildLevel *lv = (RebuildLevel*)arg;
+	for (size_t i = begin; i < end; i++) {
+		BTreeNode *leaf = (BTreeNode*)get_block(lv->disk, lv->parents[i]);
+		leaf->key = lv->recs[i].key;
+		leaf->value = lv->recs[i].value;
+		lv->parent_max[i] = leaf->key;
+	}
+}
+
+static void fill_internal(size_t begin, size_t end, void* arg)
+{
+	RebuildLevel *lv = (RebuildLevel*)arg;
+	for (size_t j = begin; j < end; j++) {
+		BTreeNode *node = (BTreeNode*)get_block(lv->disk, lv->parents[j]);
+		size_t first = j * lv->fanout;
+		size_t last = first + lv->fanout < lv->child_count ? first + lv->fanout : lv->child_count;
+
+		for (size_t c = first; c < last; c++) {
+			BTreeNode *child = (BTreeNode*)get_block(lv->disk, lv->children[c]);
+			node->children[c - first] = lv->children[c];
+			child->parent = node->block_number;
+			if (c + 1 < last) node->keys[c - first] = lv->child_max[c];
+		}
+		node->num_keys = last - first - 1;
+		lv->parent_max[j] = lv->child_max[last - 1];
+	}
+}
+
+int btree_parallel_rebuild(DiskInterface* src, uint64_t root_block, DiskInterface* dst, int num_threads, double fill_factor, uint64_t* new_root)
+{
+	BTreeRecord *recs;
+	size_t count;
+	int fanout = (int)(fill_factor * (MAX_KEYS + 1) + 0.5);
+
+	if (fanout < 2) fanout = 2;
+	if (fanout > MAX_KEYS + 1) fanout = MAX_KEYS + 1;
+
+	if (btree_parallel_collect(src, root_block, num_threads, &recs, &count) != 0) return -1;
+
+	// Block 0 holds the bitmap; only a region starting there has to reserve it
+	void *bm = get_block_bitmap(dst);
+	bool reserve = (dst->alloc_start == 0 && !bitmap_get(bm, 0));
+
+	// Leaves, every internal level and the root must fit in dst's free blocks
+	uint64_t needed = count + 1 + reserve;
+	for (size_t n = count; n > (size_t)fanout; n = (n + fanout - 1) / fanout) {
+		needed += (n + fanout - 1) / fanout;
+	}
+
+	// So must a rebuilt hash index: its directory plus buckets that split
+	// before they fill, so allow for half-full ones
+	BTreeNode *old_root = (BTreeNode*)get_block(src, root_block);
+	if (old_root->hash_index != 0) {
+		uint64_t buckets = 2 * ((count + HASH_BUCKET_ENTRIES - 1) / HASH_BUCKET_ENTRIES) + 1;
+		if (buckets > HASH_DIR_ENTRIES) buckets = HASH_DIR_ENTRIES;
+		needed += 1 + buckets;
+	}
+	uint64_t available = 0;
+	for (uint64_t b = dst->alloc_start; b < dst->alloc_end; b++) {
+		if (!bitmap_get(bm, b)) available++;
+	}
+	if (needed > available) {
+		printf("ERROR: Rebuild needs %lu blocks but only %lu are free\n", needed, available);
+		free(recs);
+		return -1;
+	}
+
+	if (reserve) alloc_page(dst);
+	BTreeNode *root = btree_node_create(dst, false);
+
+	// Pages are allocated serially so leaves land on ascending block numbers
+	RebuildLevel lv = { dst, recs, NULL, NULL, 0, NULL, NULL, fanout };
+	lv.parents = (uint64_t*)malloc((count ? count : 1) * sizeof(uint64_t));
+	lv.parent_max = (uint64_t*)malloc((count ? count : 1) * sizeof(uint64_t));
+	for (size_t i = 0; i < count; i++) {
+		lv.parents[i] = btree_node_create(dst, true)->block_number;
+	}
+	parallel_for(num_threads, count, fill_leaves, &lv);
+
+	size_t level_count = count;
+	while (level_count > (size_t)fanout) {
+		lv.children = lv.parents;
+		lv.child_max = lv.parent_max;
+		lv.child_count = level_count;
+		level_count = (level_count + fanout - 1) / fanout;
+		lv.parents = (uint64_t*)malloc(level_count * sizeof(uint64_t));
+		lv.parent_max = (uint64_t*)malloc(level_count * sizeof(uint64_t));
+		for (size_t j = 0; j < level_count; j++) {
+			lv.parents[j] = btree_node_create(dst, false)->block_number;
+		}
+		parallel_for(num_threads, level_count, fill_internal, &lv);
+		free(lv.children);
+		free(lv.child_max);
+	}
+
+	for (size_t i = 0; i < level_count; i++) {
+		BTreeNode *child = (BTreeNode*)get_block(dst, lv.parents[i]);
+		root->children[i] = lv.parents[i];
+		child->parent = root->block_number;
+		if (i + 1 < level_count) root->keys[i] = lv.parent_max[i];
+	}
+	root->num_keys = level_count ? level_count - 1 : 0;
+
+	free(lv.parents);
+	free(lv.parent_max);
+	free(recs);
+
+	// The tree is complete either way; only its index can still be missing
+	*new_root = root->block_number;
+	if (old_root->hash_index != 0 && btree_build_hash_index(dst, root->block_number) != 0) {
+		printf("ERROR: Rebuilt tree at block %lu has no hash index\n", root->block_number);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "config.h"
+#include "disk.h"
+#include "btr.h"
+
+// ==================== PARALLEL TREE OPERATIONS ====================
+
+// Called once for every node reachable from the root. worker identifies the
+// calling thread (0 .. num_threads-1) so visitors can keep per-thread state.
+typedef void (*BTreeVisitor)(DiskInterface* disk, BTreeNode* node, void* arg, int worker);
+
+// Flat record written by btree_parallel_export
+typedef struct BTreeRecord {
+    uint64_t key;			// Leaf key
+    uint64_t value;			// Leaf value
+} BTreeRecord;
+
+typedef struct BTreeAggregate {
+    uint64_t leaves;			// Number of leaf nodes (keys)
+    uint64_t internal;			// Number of internal nodes
+    uint64_t min_key;			// Smallest leaf key
+    uint64_t max_key;			// Largest leaf key
+    uint64_t key_sum;			// Sum of leaf keys (wraps on overflow)
+} BTreeAggregate;
+
+// Work-stealing traversal: every internal node's children become tasks. It
+// visits nodes only; updates still buffered at the root are not nodes, so
+// jobs built on it merge them in with btree_buffer_net. None of these take
+// locks: callers keep writers out for the duration, as shard_range_scan does.
+int btree_parallel_walk(DiskInterface* disk, uint64_t root_block, int num_threads, BTreeVisitor visit, void* arg);
+
+// Tree-wide jobs built on the traversal
+int btree_parallel_aggregate(DiskInterface* disk, uint64_t root_block, int num_threads, BTreeAggregate* out);
+uint64_t btree_parallel_count(DiskInterface* disk, uint64_t root_block, int num_threads);
+int64_t btree_parallel_export(DiskInterface* disk, uint64_t root_block, int num_threads, const char* filename);
+// Rebuild returns -1 if the tree, or the hash index it carries over, cannot be built
+int btree_parallel_rebuild(DiskInterface* src, uint64_t root_block, DiskInterface* dst, int num_threads, double fill_factor, uint64_t* new_root);
+
+#endif
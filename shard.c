@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shard.h"
+#include "parallel.h"
+#include "bitmap.h"
+#include "hash.h"
+#include "epoch.h"
+
+int shard_format(DiskInterface* disk, int num_shards, ShardRouting routing, uint64_t max_key)
+{
+	Superblock *super = (Superblock*)get_superblock(disk);
+	uint64_t usable = disk->alloc_end;
+
+	if (num_shards < 1 || num_shards > MAX_SHARDS) {
+		printf("ERROR: Shard count must be between 1 and %d\n", MAX_SHARDS);
+		return -1;
+	}
+
+	// Regions are whole bitmap words so shards never share one
+	uint64_t region = (usable / num_shards) & ~(uint64_t)63;
+	if (region < 64) {
+		printf("ERROR: Image too small for %d shards\n", num_shards);
+		return -1;
+	}
+
+	// The bitmap and the superblock are reserved before any shard allocates
+	memset(super, 0, BLOCK_SIZE);
+	bitmap_put(get_block_bitmap(disk), 0, 1);
+	bitmap_put(get_block_bitmap(disk), SUPERBLOCK_BLOCK, 1);
+
+	uint64_t width = max_key / num_shards + 1;
+	for (int i = 0; i < num_shards; i++) {
+		ShardEntry *entry = &super->shards[i];
+		DiskInterface view = *disk;
+
+		entry->alloc_start = i * region;
+		entry->alloc_end = (i == num_shards - 1) ? usable : (i + 1) * region;
+		entry->key_start = i * width;
+
+		view.alloc_start = entry->alloc_start;
+		view.alloc_end = entry->alloc_end;
+		view.retired = NULL;
+		entry->root_block = btree_node_create(&view, false)->block_number;
+	}
+
+	super->num_shards = num_shards;
+	super->routing = routing;
+	super->magic = SHARD_MAGIC;
+
+	return 0;
+}
+
+ShardSet* shard_open(DiskInterface* disk)
+{
+	Superblock *super = (Superblock*)get_superblock(disk);
+
+	if (super->magic != SHARD_MAGIC) {
+		fprintf(stderr, "Image is not sharded!!");
+		return NULL;
+	}
+
+	ShardSet *set = (ShardSet*)malloc(sizeof(ShardSet));
+	set->disk = disk;
+	set->super = super;
+
+	for (int i = 0; i < super->num_shards; i++) {
+		set->views[i] = *disk;
+		set->views[i].alloc_start = super->shards[i].alloc_start;
+		set->views[i].alloc_end = super->shards[i].alloc_end;
+		set->views[i].retired = NULL;		// Each shard reclaims its own pages
+		pthread_mutex_init(&set->locks[i], NULL);
+	}
+
+	return set;
+}
+
+void shard_close(ShardSet* set)
+{
+	for (int i = 0; i < set->super->num_shards; i++) {
+		epoch_release(&set->views[i]);
+		pthread_mutex_destroy(&set->locks[i]);
+	}
+	free(set);
+}
+
+int shard_of(ShardSet* set, uint64_t key)
+{
+	Superblock *super = set->super;
+
+	if (super->routing == SHARD_ROUTE_HASH) {
+		return hash_u64(key) % super->num_shards;
+	}
+
+	int i;
+	for (i = super->num_shards - 1; i > 0 && key < super->shards[i].key_start; i--);
+	return i;
+}
+
+int shard_insert(ShardSet* set, uint64_t key)
+{
+	int i = shard_of(set, key);
+
+	pthread_mutex_lock(&set->locks[i]);
+	int rv = btree_insert(&set->views[i], set->super->shards[i].root_block, key);
+	pthread_mutex_unlock(&set->locks[i]);
+
+	return rv;
+}
+
+int shard_delete(ShardSet* set, uint64_t key)
+{
+	int i = shard_of(set, key);
+
+	pthread_mutex_lock(&set->locks[i]);
+	int rv = btree_delete(&set->views[i], set->super->shards[i].root_block, key);
+	pthread_mutex_unlock(&set->locks[i]);
+
+	return rv;
+}
+
+uint64_t shard_lookup(ShardSet* set, uint64_t key, BTreeAccessPath path)
+{
+	int i = shard_of(set, key);
+	uint64_t root_block = set->super->shards[i].root_block;
+
+	// Optimistic readers validate node versions and never take the shard lock
+	if (path == BTREE_ACCESS_OPTIMISTIC) {
+		return btree_lookup(&set->views[i], root_block, key, path);
+	}
+
+	pthread_mutex_lock(&set->locks[i]);
+	uint64_t rv = btree_lookup(&set->views[i], root_block, key, path);
+	pthread_mutex_unlock(&set->locks[i]);
+
+	return rv;
+}
+
+typedef struct ScanRun {
+	uint64_t lo;
+	uint64_t hi;
+	BTreeRecord *recs;
+	size_t count;
+	size_t capacity;
+	size_t pos;
+	BTreeMessage net[MSG_BUFFER_SIZE];	// Shard's pending updates, merged into the run
+	int num_net;
+} ScanRun;
+
+static void scan_push(ScanRun* run, uint64_t key, uint64_t value)
+{
+	if (key < run->lo || key > run->hi) return;
+
+	if (run->count == run->capacity) {
+		run->capacity = run->capacity ? run->capacity * 2 : 64;
+		run->recs = (BTreeRecord*)realloc(run->recs, run->capacity * sizeof(BTreeRecord));
+	}
+	run->recs[run->count].key = key;
+	run->recs[run->count].value = value;
+	run->count++;
+}
+
+static void scan_visit(DiskInterface* disk, BTreeNode* node, void* arg, int worker)
+{
+	ScanRun *run = (ScanRun*)arg;
+
+	if (!node->is_leaf || btree_buffer_find(run->net, run->num_net, node->key) != NULL) return;
+	scan_push(run, node->key, node->value);
+}
+
+static int scan_compare(const void* a, const void* b)
+{
+	const BTreeRecord *ra = (const BTreeRecord*)a;
+	const BTreeRecord *rb = (const BTreeRecord*)b;
+	return (ra->key > rb->key) - (ra->key < rb->key);
+}
+
+int64_t shard_range_scan(ShardSet* set, uint64_t lo, uint64_t hi, void (*callback)(uint64_t key, uint64_t value, void* arg), void* arg)
+{
+	Superblock *super = set->super;
+	ScanRun runs[MAX_SHARDS];
+	int first = 0, last = super->num_shards - 1;
+	int64_t total = 0;
+
+	// Range routing only has to visit the shards whose ranges overlap [lo, hi]
+	if (super->routing == SHARD_ROUTE_RANGE) {
+		first = shard_of(set, lo);
+		last = shard_of(set, hi);
+	}
+
+	memset(runs, 0, sizeof(runs));
+	for (int i = first; i <= last; i++) {
+		runs[i].lo = lo;
+		runs[i].hi = hi;
+		pthread_mutex_lock(&set->locks[i]);
+		uint64_t root_block = super->shards[i].root_block;
+		runs[i].num_net = btree_buffer_net((BTreeNode*)get_block(&set->views[i], root_block), runs[i].net);
+		btree_parallel_walk(&set->views[i], root_block, 1, scan_visit, &runs[i]);
+		pthread_mutex_unlock(&set->locks[i]);
+		for (int j = 0; j < runs[i].num_net; j++) {
+			if (runs[i].net[j].op == BTREE_MSG_INSERT) scan_push(&runs[i], runs[i].net[j].key, 0);
+		}
+		qsort(runs[i].recs, runs[i].count, sizeof(BTreeRecord), scan_compare);
+	}
+
+	// Merge the per-shard runs into one ascending stream
+	while (true) {
+		int best = -1;
+		for (int i = first; i <= last; i++) {
+			if (runs[i].pos < runs[i].count &&
+			    (best == -1 || runs[i].recs[runs[i].pos].key < runs[best].recs[runs[best].pos].key)) {
+				best = i;
+			}
+		}
+		if (best == -1) break;
+
+		BTreeRecord *rec = &runs[best].recs[runs[best].pos++];
+		callback(rec->key, rec->value, arg);
+		total++;
+	}
+
+	for (int i = first; i <= last; i++) {
+		free(runs[i].recs);
+	}
+
+	return total;
+}
@@ -0,0 +1,58 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "config.h"
+#include "disk.h"
+#include "btr.h"
+
+// ==================== SHARDED IMAGES ====================
+
+#define SHARD_MAGIC 0x53484152		// "SHAR"
+
+// How keys are assigned to shards
+typedef enum ShardRouting {
+    SHARD_ROUTE_RANGE,			// Contiguous key ranges, in shard order
+    SHARD_ROUTE_HASH,			// hash_u64(key) % num_shards
+} ShardRouting;
+
+// One independent tree and the slice of the block bitmap it allocates from
+typedef struct ShardEntry {
+    uint64_t root_block;		// Root of this shard's tree
+    uint64_t alloc_start;		// First block of the shard's region (multiple of 64)
+    uint64_t alloc_end;			// One past the last block of the region
+    uint64_t key_start;			// Smallest key routed here (range routing)
+} ShardEntry;
+
+// Root table stored in the superblock (SUPERBLOCK_BLOCK)
+typedef struct Superblock {
+    uint32_t magic;			// SHARD_MAGIC once formatted
+    uint32_t num_shards;		// Number of entries in shards[]
+    uint32_t routing;			// ShardRouting
+    uint32_t reserved;
+    ShardEntry shards[MAX_SHARDS];
+} Superblock;
+
+_Static_assert(sizeof(Superblock) <= BLOCK_SIZE, "Superblock must fit in one block");
+
+// In-memory handle for a sharded image
+typedef struct ShardSet {
+    DiskInterface* disk;		// Whole image
+    Superblock* super;
+    DiskInterface views[MAX_SHARDS];	// Per-shard views that allocate only inside their region
+    pthread_mutex_t locks[MAX_SHARDS];	// Serializes writers within a shard
+} ShardSet;
+
+// Shard operations
+int shard_format(DiskInterface* disk, int num_shards, ShardRouting routing, uint64_t max_key);
+ShardSet* shard_open(DiskInterface* disk);
+void shard_close(ShardSet* set);
+int shard_of(ShardSet* set, uint64_t key);
+int shard_insert(ShardSet* set, uint64_t key);
+int shard_delete(ShardSet* set, uint64_t key);
+uint64_t shard_lookup(ShardSet* set, uint64_t key, BTreeAccessPath path);
+int64_t shard_range_scan(ShardSet* set, uint64_t lo, uint64_t hi, void (*callback)(uint64_t key, uint64_t value, void* arg), void* arg);
+
+#endif